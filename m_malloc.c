@@ -4,108 +4,5980 @@
  * Main principles:
  * - handles arbitrary request sequences
  * - responds immediately with no reordering or buffering of requests
- * - uses only the heap
  * - blocks are aligned properly
  * - allocated blocks are not modified
  *
  * Design considerations:
- * - explicit free list (singly-linked list)
+ * - one large PROT_NONE reservation made on first use, pages are committed on
+ *   demand: [page map | heap region | large region]
+ * - pointers are classified by address range (heap, large or foreign) before
+ *   any metadata is read
+ * - small requests (up to SMALL_MAX) are served from size-class slabs through
+ *   per-thread object caches
+ * - hybrid backend: requests up to the mmap threshold are carved from the
+ *   heap region, larger requests get a page run in the large region
+ * - page multiples above SMALL_MAX always get a page run, whatever the
+ *   threshold, so that e.g. O_DIRECT buffers are page-aligned and take no
+ *   extra page for a header
+ * - dynamic mmap threshold: freeing a large block above the threshold raises
+ *   the threshold to that size (as glibc's M_MMAP_THRESHOLD does), so
+ *   short-lived medium-size buffers move to the heap
+ *
+ * Heap region:
+ * - split into power-of-two arenas, each with its own lock, free list and
+ *   top; a chunk's arena follows from its address
+ * - boundary tags
+ * - explicit free list (doubly-linked list)
  * - first fit
  * - last-in, first-out ordering
- * - no splitting
- * - no coalescing
- * - no min sbrk increment
- * - not thread-safe
+ * - splitting
+ * - immediate coalescing
+ * - min heap increment, top of the heap is decommitted past the trim threshold
+ *
+ * Large region:
+ * - page runs described by a flat page map, one entry per page
+ * - no in-band header: blocks are page-aligned and a page-multiple request
+ *   takes exactly that many pages
+ * - free runs binned by length, immediate coalescing
+ * - free runs are purged, runs ending at the top are decommitted; with a
+ *   decay time they stay dirty for reuse until the oldest has aged past it
+ *
+ * Slabs:
+ * - page runs in the large region holding up to 256 objects of one size class
+ * - free slots tracked in a 256-bit bitmap in an out-of-band slab header,
+ *   found with tzcnt (one AVX2 compare when built with ENABLE_AVX2=1)
+ * - cache refills take many slots in one pass over the bitmap
+ * - partial slabs are kept on lists by occupancy and the fullest are used
+ *   first, to pack objects densely
+ * - up to EMPTY_SLABS_MAX empty slabs per class, plus the prewarmed ones, are
+ *   kept for reuse; the runs
+ *   of the rest are cached on lock-free stacks by page count, shared by all
+ *   classes, and only go back to the page runs, which purge them, once
+ *   SLAB_RUNS_MAX are cached; the stacks are refilled from the page runs in
+ *   batches, so slab churn rarely takes the run lock
+ * - tagged allocations (m_malloc_tagged, or m_tag_set for a thread) come
+ *   from slabs of their tag, kept on per-tag central lists created on first
+ *   use, up to TAG_SMALL_MAX: tags have size classes above SMALL_MAX of
+ *   their own, so a mid-size tagged block does not take whole pages. Larger
+ *   ones and page multiples take page runs; the tag is in the slab header
+ *   and the page map, so it costs no byte per object. Each thread caches
+ *   small objects of its m_tag_set tag, or of TAG_LONG if it has none, next
+ *   to its untagged ones, and moves that cache to a new tag when it changes;
+ *   other tagged objects take their central list lock on every call
+ * - m_malloc_flags hints use two internal tags: M_HOT slabs are carved from
+ *   2 MiB aligned, THP-backed, prefaulted chunks and never given back;
+ *   M_COLD slabs and runs get MADV_COLD on purges and MADV_PAGEOUT under
+ *   cgroup pressure, so the hot working set is not interleaved with them
+ * - M_SHORT_LIVED blocks are bumped out of a per-thread SHORT_REGION page
+ *   run, each after its size; frees decrement the region's live count, and
+ *   the region goes back whole, or is bumped again from the start, once it
+ *   drops to zero
+ * - lifetime prediction (lifetime): one allocation in about LIFE_SAMPLE per
+ *   thread is sampled into TAG_SAMPLED slabs or runs and timed until it is
+ *   freed, per call site in a table like prof's; sites whose samples are
+ *   nearly all freed within LIFE_SHORT_NS go to the short-lived regions, and
+ *   sites whose small blocks nearly all outlive LIFE_LONG_NS go to TAG_LONG
+ *   slabs, through the thread's tag cache, kept dense by having no
+ *   short-lived neighbours (cf. LLAMA, ASPLOS '20); any other allocation
+ *   pays a countdown, and a site lookup once some site is routed. Samples
+ *   wait in a small table hashed by address, so the lock over it is held for
+ *   LIFE_PROBES slots at most
+ * - with MESHING=1 m_malloc_mesh() merges one-page slabs whose occupied slots
+ *   do not overlap: objects are copied into one physical page and both
+ *   virtual pages are remapped onto it, so pointers stay valid while RSS drops
+ *   (cf. Mesh, PLDI '19); only meshed pages are moved into a memfd, the rest
+ *   of the large region stays private anonymous memory
+ *
+ * Threads:
+ * - thread caches are lock-free; they refill and flush whole batches of
+ *   CACHE_BATCH objects. Other threads take them back through a handshake:
+ *   the owner marks them in use with plain stores, and the taker pays for the
+ *   fence with one membarrier system call per pass
+ * - batches move between threads through a per-class transfer cache, an array
+ *   of batches under a lock held only to copy one batch
+ * - the transfer cache falls back to the per-class central list, which owns
+ *   the partial slabs
+ * - threads are given a heap arena round-robin; a thread that finds its
+ *   arena locked moves to a less loaded one if the lock there is free
+ * - one lock protects the page runs and the metadata; central list locks are
+ *   taken before arena locks, and both before it
+ * - arena, central list and transfer cache locks are spin-then-futex locks
+ *   that count acquisitions, contended acquisitions and the time spent
+ *   waiting; the page run lock stays a pthread mutex, as it is held across
+ *   system calls
+ * - m_free_deferred queues a pointer on the calling thread's bounded ring; a
+ *   reclaimer thread, started on first use, frees the queued pointers in
+ *   batches and does the purging they cause; a thread whose ring is full
+ *   frees synchronously, so a reclaimer that falls behind slows producers
+ *   down instead of letting the queues grow
+ * - an optional background thread wakes every background_interval_ms to
+ *   purge aged dirty runs (foreground frees then skip it), take back the
+ *   caches of idle threads, keep the transfer caches of hot classes half full,
+ *   free retired epoch batches, mesh every BACKGROUND_MESH_PASSES passes and
+ *   merge the stats that m_mallctl then reads without taking every lock
+ * - epoch-based reclamation: readers announce the global epoch between
+ *   m_epoch_enter and m_epoch_exit; blocks passed to m_free_after_epoch are
+ *   batched per thread and freed through the normal free path once the
+ *   epoch has moved on twice, so they land in the freeing thread's caches
+ *
+ * Configuration:
+ * - M_MALLOC_CONF="key:value,..." is read once at init, without allocating:
+ *   engine (hybrid, heap or runs), tcache_max (objects per class and thread),
+ *   decay_ms (how long freed pages stay dirty before they are purged, -1 for
+ *   never), thp (default, always or never), narenas (heap arenas, one per
+ *   CPU by default), prof (sample allocation sites from the start),
+ *   stats_print (print stats at exit), background_thread and
+ *   background_interval_ms (see below), prewarm_small, prewarm_large,
+ *   realtime, soft_limit, hard_limit, cgroup and lifetime
+ * - prewarming (m_malloc_init, or a constructor when prewarm_small or
+ *   prewarm_large is set) prefaults prewarm_small bytes of empty slabs per
+ *   size class, kept by their class for good, and prewarm_large bytes of
+ *   free pages at the top of the large region, which is never decommitted
+ *   below them; they are purged like any other dirty run
+ * - real-time mode (realtime, or m_init_opts.realtime) prewarms, then mlocks
+ *   everything committed and freezes it: requests above SMALL_MAX take page
+ *   runs, no page is committed, purged or decommitted again, realloc copies
+ *   instead of calling mremap and locks are spun on instead of slept on, so
+ *   m_malloc and m_free never enter the kernel and fail with ENOMEM once the
+ *   pools are used up; every operation is bounded: a thread cache hit, one
+ *   batch from a transfer cache or a central list, an exact run bin or at
+ *   most RUN_SCAN_MAX runs of the last one; m_free_deferred, the background
+ *   thread and meshing are not real-time and purging ctls fail with EPERM
+ * - limits: every block is charged to the allocating thread's arena and the
+ *   process, and credited on free to the same arena, by its usable size: a
+ *   heap block's arena is its slice, the charge map keeps the others'.
+ *   Threads add charges up in a thread-local count per arena and settle one
+ *   with two atomics only once it reaches CHARGE_BATCH either way, which is
+ *   also the only time the limits are checked. Past soft_limit the thread that notices purges
+ *   everything and takes back every thread's caches, at most every
+ *   LIMIT_PURGE_MS; a charge past hard_limit, or past its arena's quota,
+ *   fails with ENOMEM; crossing a warning level calls limit.hook. Purging
+ *   and the hook wait until the m_malloc call is about to return, so no lock
+ *   is held
+ * - cgroup (on by default): in a cgroup v2 with a memory.max, memory.current
+ *   is polled every CGROUP_POLL_MS, by the background thread if it runs and
+ *   otherwise by a thread settling its charges; memory.pressure is asked for
+ *   a PSI event when writable. Near memory.max, or on an event, everything
+ *   is purged on every poll and frees purge and trim at once, until usage
+ *   is back under CGROUP_LOW eighths of the limit
+ * - the options are plain opt_* globals, written by conf_init only and
+ *   read-only after init; m_mallctl reports them as configured. Settings
+ *   that change at runtime (the decay time, the limits, lifetime prediction,
+ *   the mmap threshold) live in state of their own, seeded from them
+ * - m_mallctl(name, oldp, oldlenp, newp, newlen) reads stats and options and
+ *   triggers maintenance at runtime, jemalloc style; it takes the locks it
+ *   needs and touches nothing on the fast path
+ * - stats are counted under the locks the slow paths already hold; small
+ *   objects count as allocated once they leave their slab for a thread cache
+ * - the profiler samples slow paths only: a cache refill charges its whole
+ *   batch to the caller that triggered it, heap and large allocations are
+ *   charged individually
+ *
+ * Metadata:
+ * - slab headers, thread caches, transfer caches and central lists live on
+ *   dedicated RUN_META pages in the large region, never next to objects, so a
+ *   forked child that touches allocator state does not copy object pages
+ * - the charge map has a byte for every ALIGNMENT bytes of the large region,
+ *   the arena charged for the block that starts there; it is committed with
+ *   the page map, in a range of its own, and every allocation there writes
+ *   it, so only its pages are copied for a forked child's allocations
+ * - a forked child starts with empty thread caches, their objects back in
+ *   their slabs, which only writes metadata pages; the short-lived regions
+ *   of the threads it lost are retired and their retired epoch blocks freed
+ * - only the heap region keeps in-band boundary tags and free list links:
+ *   every heap malloc or free in a forked child writes the object pages
+ *   around the chunk, which copies them; prefork servers that want the most
+ *   shared RSS can keep objects out of the heap with engine:runs
  */
 
+#define _GNU_SOURCE
+
 #include "m_malloc.h"
 
 #include <libc.h>
+#include <limits.h>
+#include <pthread.h>
+
+#include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/membarrier.h>
+#include <poll.h>
+#include <sched.h>
+#include <sys/syscall.h>
+
+#if MESHING
+#include <signal.h>
+#endif
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+#define ALIGNMENT	   _Alignof(max_align_t)
+#define HEAP_INCREMENT	   (128 * 1024UL)
+#define MMAP_THRESHOLD_MIN (128 * 1024UL)
+#define MMAP_THRESHOLD_MAX (4 * 1024 * 1024 * sizeof(long))
+
+/* address space reservation, halved on failure down to the minimum */
+#define RESERVE_SIZE	 (128UL << 30)
+#define RESERVE_SIZE_MIN (1UL << 30)
+
+/* heap arenas */
+#define MAX_ARENAS 64
+
+/* limits: a thread's charges reach the shared counts in batches */
+#define CHARGE_BATCH   (64 * 1024L)
+#define LIMIT_PURGE_MS 10 /* between two purges past the soft limit */
+#define LIMIT_PURGE    0x1U
+#define LIMIT_NEAR     0x2U /* the process crossed its warning level */
+#define LIMIT_QUOTA    0x4U /* thread_quota_arena crossed 7/8 of its quota */
+#define LIMIT_CGROUP   0x8U /* the cgroup is due to be polled */
+
+/* cgroup v2: memory.current is polled this often; past CGROUP_HIGH eighths
+ * of memory.max, or on a memory.pressure event, purging is aggressive until
+ * usage falls under CGROUP_LOW eighths */
+#define CGROUP_POLL_MS 100
+#define CGROUP_HIGH    7
+#define CGROUP_LOW     6
+#define CGROUP_PSI     "some 150000 2000000" /* 150 ms stalled in 2 s */
+
+/* internal locks: adaptive spin limit before sleeping on the futex */
+#define LOCK_SPIN_MAX 1000
+
+/* M_MALLOC_CONF engines for requests above SMALL_MAX */
+#define ENGINE_HYBRID 0 /* heap up to the dynamic mmap threshold, then runs */
+#define ENGINE_HEAP   1 /* heap up to MMAP_THRESHOLD_MAX */
+#define ENGINE_RUNS   2 /* page runs only */
+
+/* M_MALLOC_CONF transparent huge page modes */
+#define THP_DEFAULT 0
+#define THP_ALWAYS  1
+#define THP_NEVER   2
+
+/* allocation profile: call sites, open addressing */
+#define PROF_BITS  10
+#define PROF_SITES (1U << PROF_BITS)
+
+/* allocation-site lifetimes, learned from samples in a table like prof's */
+#define LIFE_SAMPLE   512 /* mean allocations between samples, per thread */
+#define LIFE_TRACKED  256 /* sampled blocks waiting to be freed */
+#define LIFE_PROBES   4	  /* sites, or sample slots, looked at per lookup */
+#define LIFE_SHORT_NS 100000UL	   /* freed sooner: short-lived */
+#define LIFE_LONG_NS  1000000000UL /* still live later: long-lived */
+#define LIFE_MIN      16 /* lifetimes of a site before it is routed */
+#define LIFE_WINDOW   64 /* lifetimes of a site before they are halved */
+#define LIFE_NONE     0
+#define LIFE_SHORT    1
+#define LIFE_LONG     2
+
+/* chunk flags, kept in the low bits of the size field */
+#define CHUNK_INUSE	 0x1UL
+#define CHUNK_PREV_INUSE 0x2UL
+#define CHUNK_FLAGS	 (CHUNK_INUSE | CHUNK_PREV_INUSE)
+
+/* small size classes */
+#define SMALL_MAX   1024
+#define NUM_CLASSES 20
+#define TAG_SMALL_MAX 7168 /* tagged blocks take slabs up to here */
+#define TAG_CLASSES   (NUM_CLASSES + 11) /* the ones above are tagged only */
+#define SLAB_SLOTS  256
+#define SLAB_WORDS  (SLAB_SLOTS / 64)
+#define SLAB_PAGES_MAX 8
+#define CACHE_SLOTS 64
+#define CACHE_BATCH 32
+#define TRANSFER_BATCHES 16
+#define DEFER_SLOTS 1024 /* deferred frees queued per thread */
+#define DEFER_WAIT_MS 10 /* reclaimer poll interval while there is work */
+#define RETIRE_BATCH 64	 /* blocks retired per thread before a batch */
+
+/* background thread: a class refilled this often per pass is prefilled */
+#define BACKGROUND_HOT	       8
+#define BACKGROUND_MESH_PASSES 10 /* passes between two meshing rounds */
+#define META_PAGES  16
+
+/* slab lists: partial slabs by occupancy (fullest last), then empty slabs */
+#define OCCUPANCY_LISTS 4
+#define SLAB_EMPTY	OCCUPANCY_LISTS
+#define SLAB_LISTS	(OCCUPANCY_LISTS + 1)
+#define SLAB_FULL	SLAB_LISTS /* on no list */
+#define EMPTY_SLABS_MAX 1
+
+/* slab runs: empty slab page runs kept per page count for lock-free reuse */
+#define SLAB_RUNS_MAX  16 /* per page count, the rest go to the page runs */
+#define SLAB_RUN_BATCH 4  /* taken from the page runs per refill */
+
+/* meshing: virtual pages that may share one slab's physical page */
+#define MESH_MAX	16
+#define MESH_LISTS	2 /* occupancy lists searched for mesh candidates */
+
+/* page run flags, slab pages keep their size class in the high bits */
+#define RUN_INUSE	0x1U
+#define RUN_SLAB	0x2U /* set on every page of a slab */
+#define RUN_META	0x4U
+#define RUN_DIRTY	0x8U /* free, or taken from a free run, and not purged */
+#define RUN_SHORT	0x10U /* set on every page of a short-lived region */
+#define RUN_CLASS_SHIFT 8
+#define RUN_TAG_SHIFT	16 /* on every page of a tagged slab, or the ends of a
+			      tagged run */
+#define RUN_TAG_MASK	(0x1ffU << RUN_TAG_SHIFT)
+
+/* internal tags past the user's, for hints and lifetime prediction */
+#define TAG_HOT	    M_TAGS
+#define TAG_COLD    (M_TAGS + 1)
+#define TAG_SAMPLED (M_TAGS + 2) /* lifetime samples */
+#define TAG_LONG    (M_TAGS + 3) /* predicted long-lived */
+#define TAGS	    (M_TAGS + 4)
+#define HOT_CHUNK (2UL << 20) /* hot slabs are carved from huge pages */
+
+/* short-lived bump regions, see short_malloc */
+#define SHORT_REGION (256UL << 10)
+#define SHORT_MAX    (SHORT_REGION / 8) /* larger blocks are not bumped */
+
+#define RUN_NIL	 UINT32_MAX
+#define RUN_BINS 64
+#define RUN_SCAN_MAX 64 /* runs of the last bin tried in real-time mode */
+
+/**
+ * Header - boundary tag at the start of every heap chunk. prev_size is only
+ * valid while the previous chunk is free.
+ */
+typedef struct header Header;
+struct header {
+	size_t prev_size;
+	size_t size; /* chunk size in bytes, CHUNK_* flags in the low bits */
+} __attribute__((aligned(ALIGNMENT)));
+
+/**
+ * FreeChunk - a free heap chunk, linked into the free list.
+ */
+typedef struct free_chunk FreeChunk;
+struct free_chunk {
+	Header	   header;
+	FreeChunk *next;
+	FreeChunk *prev;
+};
+
+#define MIN_CHUNK_SIZE sizeof(FreeChunk)
+
+/**
+ * Lock - test-and-test-and-set lock for short critical sections. Spins for
+ * about as long as it recently took to get the lock, then sleeps on a futex.
+ * The counters are only written by the holder.
+ */
+typedef struct lock Lock;
+struct lock {
+	uint32_t state; /* 0 free, 1 locked, 2 locked with sleepers */
+	uint32_t spin;	/* adaptive spin limit */
+	uint64_t nacquired;
+	uint64_t ncontended; /* acquisitions that found the lock taken */
+	uint64_t wait_ns;    /* time spent waiting in those */
+};
+
+/**
+ * Arena - one slice of the heap region with its own lock, free list and top.
+ * Slices are 1 << arena_shift bytes; the chunks of a slice never span two.
+ */
+typedef struct arena Arena;
+struct arena {
+	Lock		lock;
+	FreeChunk      *free_list;
+	char	       *start;
+	char	       *end;	   /* end of the heap, after the epilogue */
+	char	       *committed; /* end of the committed heap pages */
+	char	       *limit;	   /* end of the slice */
+	size_t		allocated;
+	unsigned	nthreads; /* threads using this arena, atomic */
+	int		near_quota; /* charged is past 7/8 of the quota */
+	long		charged;    /* bytes charged by its threads, atomic */
+	size_t		quota;	    /* 0 for none, atomic */
+} __attribute__((aligned(64)));
+
+/**
+ * Slab - header of a slab, kept out of band in metadata pages. One cache
+ * line.
+ */
+typedef struct slab Slab;
+struct slab {
+	uint64_t bitmap[SLAB_WORDS]; /* set bits are free slots */
+	char	*base;
+	Slab	*next; /* slab list, or the descriptor pool */
+	Slab	*prev;
+	uint32_t size;
+	uint8_t	 size_class;
+	uint8_t	 list; /* index into CentralList.lists, or SLAB_FULL */
+	uint16_t tag;
+#if MESHING
+	uint32_t nmeshed;
+	uint32_t meshed[MESH_MAX - 1]; /* other pages mapping this slab */
+#endif
+} __attribute__((aligned(64)));
+
+/**
+ * SizeClass - object size and slab geometry of a small size class.
+ * div_magic turns a division by size into a multiply and a shift; offset_mask
+ * finds an object's offset from any virtual page of a one-page slab.
+ */
+typedef struct size_class SizeClass;
+struct size_class {
+	uint32_t size;
+	uint32_t npages;
+	uint32_t slots;
+	uint32_t div_magic;
+	uint64_t offset_mask;
+};
+
+/**
+ * Cache - objects of one size class ready to be handed out by one thread.
+ */
+typedef struct cache Cache;
+struct cache {
+	unsigned count;
+	void	*slots[CACHE_SLOTS];
+};
+
+/**
+ * DeferQueue - ring of pointers passed to m_free_deferred. The owning thread
+ * produces; the reclaimer thread, or the owner when it exits, consumes under
+ * the lock. head and tail only ever grow.
+ */
+typedef struct defer_queue DeferQueue;
+struct defer_queue {
+	unsigned head; /* next to free, written by the consumer */
+	unsigned tail; /* next free slot, written by the owner */
+	Lock	 lock;
+	void	*slots[DEFER_SLOTS];
+};
+
+/**
+ * RetireBatch - blocks passed to m_free_after_epoch, freed together once the
+ * global epoch is two past the epoch the last of them was retired in.
+ */
+typedef struct retire_batch RetireBatch;
+struct retire_batch {
+	RetireBatch *next; /* in epoch_batches */
+	uint64_t     epoch;
+	unsigned     count;
+	void	    *ptrs[RETIRE_BATCH];
+};
 
 /**
- * Header - contains information about allocated blocks.
+ * EpochState - a thread's epoch-based reclamation state. epoch is read by
+ * the threads that advance the global epoch.
  */
-typedef union header Header;
-union header {
-	struct {
-		size_t size;
-	} data;
-	max_align_t align; /* ensure proper alignment */
+typedef struct epoch_state EpochState;
+struct epoch_state {
+	uint64_t    epoch; /* global epoch << 1 | 1 in a section, 0 outside */
+	unsigned    nest;
+	RetireBatch retired; /* filled in place, copied out when full */
 };
 
+/**
+ * ThreadCache - a thread's caches, on metadata pages of their own. Flushed and
+ * recycled when the thread exits. seq and steal are the handshake through
+ * which other threads take the caches back, see thread_caches_steal.
+ */
+typedef struct thread_cache ThreadCache;
+struct thread_cache {
+	ThreadCache *next; /* in thread_caches or thread_cache_pool */
+	ThreadCache *prev;
+	ThreadCache *registry; /* every thread cache ever created */
+	unsigned     seq;      /* odd while the owner uses the caches, atomic */
+	unsigned     seq_seen; /* by the background thread's last pass */
+	int	     steal;    /* another thread is taking the caches, atomic */
+	int	     gc;       /* trim on the next slow path, atomic */
+	unsigned     tag;      /* of tag_caches, the owner's m_tag_set tag */
+	Cache	     caches[NUM_CLASSES];
+	Cache	     tag_caches[NUM_CLASSES];
+	DeferQueue   defer;
+	EpochState   epoch;
+};
+
+/**
+ * TransferCache - full batches of one size class on their way between thread
+ * caches.
+ */
+typedef struct transfer_cache TransferCache;
+struct transfer_cache {
+	Lock		lock;
+	unsigned	nbatches;
+	unsigned	nrefills; /* thread cache refills, atomic */
+	void	       *batches[TRANSFER_BATCHES][CACHE_BATCH];
+};
+
+/**
+ * CentralList - the partial and empty slabs of one size class.
+ */
+typedef struct central_list CentralList;
+struct central_list {
+	Lock		lock;
+	Slab	       *lists[SLAB_LISTS];
+	unsigned	nempty;
+	unsigned	nempty_max; /* EMPTY_SLABS_MAX, plus prewarmed slabs */
+	size_t		nallocated; /* objects out of the slabs */
+};
+
+/**
+ * TagStats - live bytes and blocks of one tag, atomic.
+ */
+typedef struct tag_stats TagStats;
+struct tag_stats {
+	size_t allocated;
+	size_t count;
+};
+
+/**
+ * ShortRegion - header of a short-lived bump region, at its start. Each block
+ * after it is preceded by its size, in ALIGNMENT bytes. live counts the
+ * blocks other threads freed, negated, until the owning thread retires the
+ * region and adds the number of its blocks it has not freed itself: whoever
+ * brings it to zero then releases it.
+ */
+typedef struct short_region ShortRegion;
+struct short_region {
+	long live; /* atomic */
+} __attribute__((aligned(64)));
+
+/**
+ * ShortBump - a thread's current short-lived region. Listed in short_bumps
+ * from its first region until the thread exits, so that a fork child can
+ * retire the regions of the threads it lost.
+ */
+typedef struct short_bump ShortBump;
+struct short_bump {
+	char	    *next;
+	char	    *end;
+	long	     count; /* blocks handed out, less those freed here */
+	ShortRegion *region;
+	ShortBump   *bumps_next; /* in short_bumps, under run_lock */
+	ShortBump   *bumps_prev;
+	int	     listed;
+};
+
+/**
+ * PageRun - page map entry for one page of the large region, the out-of-band
+ * header of large blocks. npages and flags are kept in the first and last page
+ * of every run; free runs are linked into their bin by page index, slab pages
+ * point at their slab, and short-lived region pages at their region.
+ */
+typedef struct page_run PageRun;
+struct page_run {
+	uint32_t npages;
+	uint32_t flags; /* RUN_* */
+	union {
+		struct {
+			uint32_t next;
+			uint32_t prev;
+		};
+		Slab	    *slab;
+		ShortRegion *region;
+	};
+};
+
+/**
+ * ProfSite - allocation profile of one call site, or its sampled lifetimes
+ * in the lifetime table.
+ */
+typedef struct prof_site ProfSite;
+struct prof_site {
+	void	*pc;
+	uint64_t nsamples;
+	uint64_t bytes;
+	uint16_t nlifetimes;
+	uint16_t nshort;
+	uint16_t nlong;
+	uint8_t	 verdict; /* LIFE_*, atomic */
+};
+
+/**
+ * LifeSample - a sampled block, until it is freed or found long-lived.
+ */
+typedef struct life_sample LifeSample;
+struct life_sample {
+	void	 *ptr;
+	ProfSite *site;
+	uint64_t  born; /* ns */
+};
+
+/**
+ * Stats - a snapshot of the allocator's byte counts, see m_mallctl.
+ */
+typedef struct stats Stats;
+struct stats {
+	size_t allocated;
+	size_t small_allocated;
+	size_t large_allocated;
+	size_t heap_allocated;
+	size_t mapped;
+	size_t dirty;
+	size_t metadata;
+	size_t mmap_threshold;
+};
+
+/* configuration, written by conf_init only (narenas:0 is resolved by
+ * region_init), read-only after; what may change at runtime is kept apart */
+static unsigned opt_engine = ENGINE_HYBRID;
+static unsigned opt_tcache_max = CACHE_SLOTS;
+static long	opt_decay_ms = 0;
+static unsigned opt_thp = THP_DEFAULT;
+static unsigned opt_narenas = 0; /* 0: one per CPU */
+static unsigned opt_prof = 0;
+static unsigned opt_stats_print = 0;
+static unsigned opt_background_thread = 0;
+static long	opt_background_interval_ms = 100;
+static size_t	opt_prewarm_small = 0; /* bytes per size class */
+static size_t	opt_prewarm_large = 0;
+static unsigned opt_realtime = 0;
+static size_t	opt_soft_limit = 0; /* bytes, 0 for none */
+static size_t	opt_hard_limit = 0;
+static unsigned opt_cgroup = 1;
+static unsigned opt_lifetime = 0;
+
+/* address space layout */
+static size_t	page_size;
+static unsigned page_shift;
+static PageRun *page_map;
+static uint8_t *charge_map; /* arena index per ALIGNMENT bytes, see charge */
+static char    *heap_start;
+static size_t	heap_region_size;
+static char    *large_start;
+static size_t	large_region_size;
+
+/* heap state, the thresholds are read without a lock */
+static Arena   *arenas; /* [opt_narenas], metadata */
+static unsigned arena_shift;
+static unsigned arena_next; /* round-robin assignment, atomic */
+static uint32_t lock_spin_max = LOCK_SPIN_MAX; /* 0 on one CPU */
+static size_t	mmap_threshold = MMAP_THRESHOLD_MIN;
+static size_t	trim_threshold = 2 * MMAP_THRESHOLD_MIN;
+
+/* large region state */
+static uint32_t run_bins[RUN_BINS];
+static uint64_t run_bins_used; /* bit i is set if run_bins[i] is not empty */
+static uint32_t large_top;     /* pages below the top are committed */
+static size_t	page_map_committed;
+static size_t	charge_map_committed;
+static size_t	dirty_pages; /* in free runs flagged RUN_DIRTY */
+static size_t	large_allocated;
+static size_t	meta_pages;
+static uint64_t dirty_since; /* ms, when the oldest of them was freed */
+static long	decay_ms;    /* opt_decay_ms, arena.decay_ms, -1 in real time */
+static uint32_t large_warm_pages; /* kept committed at the top, prewarmed */
+
+/* slab state */
+static SizeClass size_classes[TAG_CLASSES] = {
+    {.size = 16},   {.size = 32},	{.size = 48},	{.size = 64},
+    {.size = 80},   {.size = 96},	{.size = 112},	{.size = 128},
+    {.size = 160},  {.size = 192},	{.size = 224},	{.size = 256},
+    {.size = 320},  {.size = 384},	{.size = 448},	{.size = 512},
+    {.size = 640},  {.size = 768},	{.size = 896},	{.size = 1024},
+    {.size = 1280}, {.size = 1536}, {.size = 1792}, {.size = 2048},
+    {.size = 2560}, {.size = 3072}, {.size = 3584}, {.size = 4096},
+    {.size = 5120}, {.size = 6144}, {.size = 7168},
+};
+static uint8_t size_class_index[SMALL_MAX / 16 + 1];
+static uint8_t tag_class_index[TAG_SMALL_MAX / 256 + 1];
+static Slab *slab_pool; /* recycled slab headers */
+static uint64_t slab_runs[SLAB_PAGES_MAX]; /* Treiber stacks, tagged tops */
+static unsigned slab_runs_count[SLAB_PAGES_MAX];
+static uint32_t hot_next, hot_end; /* pages of the hot chunk left to carve */
+static char *meta_next;
+static char *meta_end;
+static ThreadCache *thread_caches; /* caches of live threads */
+static ThreadCache *thread_cache_pool;
+static ThreadCache *thread_cache_registry; /* pushed under run_lock only */
+
+/* thread state */
+static pthread_once_t	    conf_once = PTHREAD_ONCE_INIT;
+static pthread_once_t	    init_once = PTHREAD_ONCE_INIT;
+static pthread_key_t	    thread_cache_key;
+static pthread_key_t	    arena_key;
+static pthread_key_t	    short_key;
+static pthread_mutex_t	     run_lock = PTHREAD_MUTEX_INITIALIZER;
+static TransferCache	    *transfer_caches; /* [NUM_CLASSES], metadata */
+static CentralList	    *central_lists;   /* [NUM_CLASSES], metadata */
+static CentralList	    *tag_lists[TAGS]; /* [TAG_CLASSES] per tag, lazy */
+static TagStats		     tag_stats[TAGS];
+static __thread ThreadCache *thread_cache;
+static __thread Arena	    *thread_arena;
+static __thread unsigned     thread_tag; /* m_tag_set, 0 for none */
+static __thread unsigned     thread_tag_set; /* thread_tag out of m_*_tagged */
+
+/**
+ * The tag whose small objects the calling thread caches: its m_tag_set tag,
+ * or else TAG_LONG, which only untagged allocations are given.
+ */
+static inline unsigned thread_cache_tag(void) {
+	return thread_tag_set ? thread_tag_set : TAG_LONG;
+}
+static __thread ShortBump    thread_short;
+static ShortBump	    *short_bumps; /* every thread's, under run_lock */
+
+/* deferred free state */
+static int	defer_started; /* the reclaimer thread is running */
+static int	defer_idle;    /* it sleeps until woken */
+static uint32_t defer_seq;     /* futex the reclaimer sleeps on */
+
+/* epoch-based reclamation state */
+static uint64_t		epoch_global = 1;
+static RetireBatch     *epoch_batches; /* pushed one at a time, taken all */
+static unsigned		epoch_pinned;  /* sections of threads without state */
+static __thread unsigned epoch_pinned_nest;
+
+/* background thread state */
+static int		background_active; /* it runs, so decay is left to it */
+static int		background_stop;   /* futex it sleeps on between passes */
+static pthread_t	background_thread;
+static pthread_mutex_t	background_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_mutex_t	steal_lock = PTHREAD_MUTEX_INITIALIZER;
+static int		steal_membarrier; /* 1 registered, -1 unavailable */
+static Lock		background_stats_lock;
+static Stats		background_stats; /* merged on every pass */
+
+/* real-time mode, entered once by m_malloc_init: nothing is committed,
+ * purged or decommitted any more and locks are never slept on */
+static int realtime;
+
+/* limit state, see charge */
+static long		 charged_total; /* bytes, atomic */
+static size_t		 limit_soft;	/* 0 for none, atomic */
+static size_t		 limit_hard;
+static m_limit_hook_t	 limit_hook;
+static int		 limit_near;   /* charged_total is past the warning */
+static uint64_t		 limit_purged; /* ms, last purge past the soft limit */
+static __thread long	 thread_charges[MAX_ARENAS]; /* not yet settled */
+static __thread Arena	*thread_quota_arena; /* for LIMIT_QUOTA */
+static __thread unsigned thread_limit_events; /* LIMIT_* to act on */
+static __thread int	 thread_arena_bound;  /* set with thread.arena */
+
+/* cgroup state, the files of the cgroup v2 the process started in */
+static int	cgroup_max_fd = -1;	/* memory.max */
+static int	cgroup_current_fd = -1; /* memory.current */
+static int	cgroup_psi_fd = -1;	/* memory.pressure, with a trigger */
+static int	cgroup_pressure;	/* purging aggressively, atomic */
+static uint64_t cgroup_polled;		/* ms */
+
+/* profiling state */
+static ProfSite *prof_sites; /* [PROF_SITES], metadata */
+static int	 prof_active;
+
+/* lifetime prediction state */
+static ProfSite	  *life_sites; /* [PROF_SITES], metadata */
+static int	   life_active; /* opt_lifetime, until real-time mode */
+static Lock	   life_lock;	/* the samples and the sites' counts */
+static LifeSample  life_samples[LIFE_TRACKED]; /* by block address */
+static unsigned	   life_routed[3]; /* sites per verdict, but LIFE_NONE */
+static __thread int	 thread_life_countdown;
+static __thread uint64_t thread_life_seed;
+
+#if MESHING
+/* meshing state */
+static int		mesh_fd = -1;
+static pthread_mutex_t	mesh_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct sigaction mesh_old_segv;
+static volatile int	mesh_active; /* slab pages are write-protected */
+static uint32_t		mesh_count;  /* slabs whose page is in the memfd */
+static int		mesh_fork_fd; /* meshed pages copied for the child */
+#endif
+
 /* function prototypes */
-static Header *internal_malloc(size_t size);
-static Header *internal_calloc(size_t nmemb, size_t size);
-static Header *internal_realloc(Header *ptr, size_t size);
-static void    internal_free(Header *ptr);
+static void *internal_malloc(size_t size, void *caller);
+static void *internal_calloc(size_t nmemb, size_t size, void *caller);
+static void *internal_realloc(void *ptr, size_t size, void *caller);
+static void  internal_free(void *ptr);
+
+static void    free_list_insert(Arena *arena, Header *chunk);
+static void    free_list_remove(Arena *arena, Header *chunk);
+static Header *heap_malloc(Arena *arena, size_t size);
+static int     heap_resize(Arena *arena, Header *chunk, size_t size);
+static void    heap_free(Arena *arena, Header *chunk);
+static Arena  *arena_lock(void);
+static void    arena_detach(void *arg);
+static inline int charge(long bytes, int may_fail);
+static inline int charge_to(Arena *arena, long bytes, int may_fail);
+static inline void charge_map_set(void *ptr, Arena *arena);
+static inline Arena *charge_map_arena(void *ptr);
+static void    limit_handle(void);
+static void   *large_malloc(size_t size);
+static void   *large_realloc(void *ptr, size_t size);
+static void    large_free(void *ptr);
+static void   *small_malloc(size_t size, void *caller);
+static void    small_free(unsigned size_class, void *ptr);
+static void   *tagged_malloc(size_t size, unsigned tag, void *caller);
+static void    tagged_free(void *ptr, uint32_t flags);
+static inline void *life_malloc(size_t size, void *caller);
+static void    life_observe(void *ptr);
+static inline void *short_malloc(size_t size);
+static void   *short_refill(size_t size);
+static void    short_free(void *ptr);
+static void    short_detach(void *arg);
+static void    central_lock_all(void);
+static void    central_unlock_all(void);
+static int     malloc_init(void);
+static void    region_init(void);
+static void    conf_init(void);
+static void    cgroup_init(void);
+static void    cgroup_poll(void);
+static void    pages_thp(void *addr, size_t len);
+static void    runs_purge(void);
+static void    purge_all(void);
+static void    thread_cache_flush(ThreadCache *tcache);
+static void    thread_caches_steal(int idle_only);
+static void    runs_decay(void);
+static void    prof_sample(void *caller, size_t bytes);
+static void    stats_read(Stats *stats);
+static int     background_set(int active);
+static void    size_classes_init(void);
+static void   *meta_alloc(size_t size);
+static inline uint32_t slab_offset(Slab *slab, void *ptr);
+static inline uint32_t slab_slot(Slab *slab, void *ptr);
+#if MESHING
+static void mesh_init(void);
+static void mesh_map(uint32_t page, uint32_t target);
+static void mesh_unmap(uint32_t page);
+static void mesh_fork_prepare(void);
+static void mesh_fork_parent(void);
+static void mesh_fork_child(void);
+#endif
+static void    thread_cache_release(ThreadCache *tcache);
+static unsigned defer_drain(DeferQueue *queue);
+static void	epoch_flush(EpochState *state, void *caller);
+static void    thread_cache_destroy(void *arg);
+static void    fork_prepare(void);
+static void    fork_parent(void);
+static void    fork_child(void);
+
+#if CHECK_HEAP
+static void check_heap(void);
+static void check_slabs_locked(CentralList *lists, unsigned tag);
+#else
+#define check_heap() ((void)0)
+#endif
+
+/* chunk helpers */
+static inline size_t chunk_size(Header *chunk) {
+	return chunk->size & ~CHUNK_FLAGS;
+}
+
+static inline Header *next_chunk(Header *chunk) {
+	return (Header *)((char *)chunk + chunk_size(chunk));
+}
+
+static inline Header *prev_chunk(Header *chunk) {
+	return (Header *)((char *)chunk - chunk->prev_size);
+}
+
+static inline void *chunk_to_mem(Header *chunk) {
+	return chunk ? chunk + 1 : NULL;
+}
+
+static inline Header *mem_to_chunk(void *ptr) {
+	return (Header *)ptr - 1;
+}
+
+static inline size_t align_up(size_t n, size_t alignment) {
+	return (n + alignment - 1) & ~(alignment - 1);
+}
+
+static inline void *page_addr(uint32_t page) {
+	return large_start + ((size_t)page << page_shift);
+}
+
+static inline uint32_t page_index(void *ptr) {
+	return ((char *)ptr - large_start) >> page_shift;
+}
+
+static inline unsigned size_class(size_t size) {
+	return size_class_index[(size + 15) >> 4];
+}
+
+/**
+ * The size class of a tagged block, from those above SMALL_MAX too.
+ */
+static inline unsigned tag_size_class(size_t size) {
+	return size <= SMALL_MAX ? size_class(size)
+				 : tag_class_index[(size + 255) >> 8];
+}
+
+/**
+ * Whether a tagged block of this size comes from slabs: page multiples take
+ * exactly their pages instead.
+ */
+static inline int tag_slab_size(size_t size) {
+	return size <= SMALL_MAX ||
+	       (size <= TAG_SMALL_MAX && size & (page_size - 1));
+}
+
+static inline unsigned run_size_class(PageRun *run) {
+	return run->flags >> RUN_CLASS_SHIFT & 0xff;
+}
+
+static inline unsigned run_tag(PageRun *run) {
+	return (run->flags & RUN_TAG_MASK) >> RUN_TAG_SHIFT;
+}
+
+static inline CentralList *slab_central(Slab *slab) {
+	return slab->tag ? &tag_lists[slab->tag][slab->size_class]
+			 : &central_lists[slab->size_class];
+}
+
+/**
+ * Flags of a page that may belong to a cached slab run, whose flags are
+ * rewritten without the run lock. RUN_INUSE stays set throughout.
+ */
+static inline uint32_t run_flags(uint32_t page) {
+	return __atomic_load_n(&page_map[page].flags, __ATOMIC_RELAXED);
+}
+
+/* address range classification, one compare each */
+static inline int in_heap_region(void *ptr) {
+	return (uintptr_t)ptr - (uintptr_t)heap_start < heap_region_size;
+}
+
+static inline int in_large_region(void *ptr) {
+	return (uintptr_t)ptr - (uintptr_t)large_start < large_region_size;
+}
+
+/**
+ * The arena owning a heap chunk, from the chunk's address.
+ */
+static inline Arena *arena_of(void *ptr) {
+	return &arenas[((char *)ptr - heap_start) >> arena_shift];
+}
+
+/**
+ * Is ptr a large block, as opposed to a heap chunk or slab object?
+ */
+static inline int is_large_block(void *ptr) {
+	return in_large_region(ptr) &&
+	       !(page_map[page_index(ptr)].flags & (RUN_SLAB | RUN_SHORT));
+}
+
+static inline uint64_t now_ms(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static inline uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#else
+	__asm__ __volatile__("" ::: "memory");
+#endif
+}
+
+/* counters are written by the holder only, and read by stats without it */
+static inline void lock_count(uint64_t *counter, uint64_t n) {
+	__atomic_store_n(counter,
+			 __atomic_load_n(counter, __ATOMIC_RELAXED) + n,
+			 __ATOMIC_RELAXED);
+}
+
+/**
+ * Reset a lock to unlocked, keeping its counters. Also used by the child of a
+ * fork, where the holder may be gone.
+ */
+static inline void lock_init(Lock *lock) {
+	__atomic_store_n(&lock->state, 0, __ATOMIC_RELAXED);
+}
+
+static inline int lock_try(Lock *lock) {
+	uint32_t expected = 0;
+
+	if (__atomic_load_n(&lock->state, __ATOMIC_RELAXED) == 0 &&
+	    __atomic_compare_exchange_n(&lock->state, &expected, 1, 0,
+					__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+		lock_count(&lock->nacquired, 1);
+		return 1;
+	}
+	return 0;
+}
+
+/**
+ * Slow path of lock_acquire: spin on reads while the holder is likely to
+ * release soon, then mark the lock contended and sleep until woken. The spin
+ * limit follows the spins that recent acquisitions needed, as glibc's
+ * adaptive mutexes do. Real-time mode only spins, and does not time the wait:
+ * clock_gettime is a system call where the vDSO cannot read the clock, and
+ * strict seccomp makes the cycle counter trap.
+ */
+static __attribute__((noinline)) void lock_wait(Lock *lock) {
+	int	 spin_only = __atomic_load_n(&realtime, __ATOMIC_RELAXED);
+	uint64_t start = spin_only ? 0 : now_ns();
+	uint32_t spin = __atomic_load_n(&lock->spin, __ATOMIC_RELAXED);
+	uint32_t limit = 2 * spin + 10 < lock_spin_max ? 2 * spin + 10
+						       : lock_spin_max;
+	uint32_t count = 0;
+	uint32_t expected;
+
+	for (; count < limit || spin_only; count++) {
+		expected = 0;
+		if (__atomic_load_n(&lock->state, __ATOMIC_RELAXED) == 0 &&
+		    __atomic_compare_exchange_n(&lock->state, &expected, 1, 0,
+						__ATOMIC_ACQUIRE,
+						__ATOMIC_RELAXED)) {
+			break;
+		}
+		cpu_relax();
+	}
+	if (count == limit && !spin_only) {
+		/* sleepers are woken one at a time, so the lock stays marked
+		 * contended once any thread has slept on it */
+		while (__atomic_exchange_n(&lock->state, 2, __ATOMIC_ACQUIRE)) {
+			syscall(SYS_futex, &lock->state, FUTEX_WAIT_PRIVATE, 2,
+				NULL, NULL, 0);
+		}
+	}
+
+	__atomic_store_n(&lock->spin, spin + (int32_t)(count - spin) / 8,
+			 __ATOMIC_RELAXED);
+	lock_count(&lock->nacquired, 1);
+	lock_count(&lock->ncontended, 1);
+	if (!spin_only) {
+		lock_count(&lock->wait_ns, now_ns() - start);
+	}
+}
+
+static inline void lock_acquire(Lock *lock) {
+	uint32_t expected = 0;
+
+	if (__builtin_expect(__atomic_compare_exchange_n(&lock->state,
+							 &expected, 1, 0,
+							 __ATOMIC_ACQUIRE,
+							 __ATOMIC_RELAXED),
+			     1)) {
+		lock_count(&lock->nacquired, 1);
+		return;
+	}
+	lock_wait(lock);
+}
+
+static inline void lock_release(Lock *lock) {
+	if (__atomic_exchange_n(&lock->state, 0, __ATOMIC_RELEASE) == 2) {
+		syscall(SYS_futex, &lock->state, FUTEX_WAKE_PRIVATE, 1, NULL,
+			NULL, 0);
+	}
+}
+
+/**
+ * Take the run lock. In real-time mode, spin on it rather than sleep in the
+ * kernel.
+ */
+static inline void run_lock_acquire(void) {
+	if (__atomic_load_n(&realtime, __ATOMIC_RELAXED)) {
+		while (pthread_mutex_trylock(&run_lock)) {
+			cpu_relax();
+		}
+		return;
+	}
+	pthread_mutex_lock(&run_lock);
+}
+
+/**
+ * Convert a request size to a heap chunk size.
+ */
+static size_t request_to_chunk_size(size_t size) {
+	size = align_up(size + sizeof(Header), ALIGNMENT);
+	return size < MIN_CHUNK_SIZE ? MIN_CHUNK_SIZE : size;
+}
+
+/**
+ * Report a corrupted heap or invalid pointer and abort.
+ */
+static void heap_error(const char *msg, void *ptr) {
+	fprintf(stderr, "m_malloc: %s (%p)\n", msg, ptr);
+	abort();
+}
 
 /* function definitions */
+/**
+ * Act on the limits the calling thread's charges crossed, now that no lock
+ * is held.
+ */
+static inline void limit_poll(void) {
+	if (__builtin_expect(thread_limit_events != 0, 0)) {
+		limit_handle();
+	}
+}
+
 void *m_malloc(size_t size) {
-	return internal_malloc(size) + 1;
+	void *ptr = internal_malloc(size, __builtin_return_address(0));
+	check_heap();
+	limit_poll();
+	return ptr;
 }
 
 void *m_calloc(size_t nmemb, size_t size) {
-	return internal_calloc(nmemb, size) + 1;
+	void *ptr = internal_calloc(nmemb, size, __builtin_return_address(0));
+	check_heap();
+	limit_poll();
+	return ptr;
 }
 
 void *m_realloc(void *ptr, size_t size) {
 	if (ptr == NULL) {
-		return internal_malloc(size) + 1;
+		ptr = internal_malloc(size, __builtin_return_address(0));
+		check_heap();
+		limit_poll();
+		return ptr;
 	}
-	return internal_realloc((Header *)ptr - 1, size) + 1;
+	if (size == 0) {
+		m_free(ptr);
+		return NULL;
+	}
+
+	ptr = internal_realloc(ptr, size, __builtin_return_address(0));
+	check_heap();
+	limit_poll();
+	return ptr;
 }
 
 void m_free(void *ptr) {
-	internal_free((Header *)ptr - 1);
+	if (ptr == NULL) {
+		return;
+	}
+
+	internal_free(ptr);
+	check_heap();
 }
 
-static Header *internal_malloc(size_t size) {
-	if (size == 0) {
+void *m_malloc_tagged(size_t size, unsigned tag) {
+	unsigned saved = thread_tag;
+	void	*ptr;
+
+	if (tag >= M_TAGS) {
+		errno = EINVAL;
 		return NULL;
 	}
+	thread_tag = tag;
+	ptr = internal_malloc(size, __builtin_return_address(0));
+	thread_tag = saved;
+	check_heap();
+	limit_poll();
+	return ptr;
+}
 
-	size += sizeof(Header);
+unsigned m_tag_set(unsigned tag) {
+	unsigned saved = thread_tag;
 
-	void *map = mmap(NULL, size, PROT_READ | PROT_WRITE,
-			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (map == MAP_FAILED) {
-		errno = ENOMEM;
-		return NULL;
+	if (tag >= M_TAGS) {
+		errno = EINVAL;
+		return M_TAGS;
 	}
-
-	Header *header = map;
-	header->data.size = size;
-	return header;
+	thread_tag = tag;
+	thread_tag_set = tag;
+	return saved;
 }
 
-static Header *internal_calloc(size_t nmemb, size_t size) {
-	size_t total_size = nmemb * size;
-	if (nmemb && total_size / nmemb != size) {
-		errno = EOVERFLOW;
+void *m_malloc_flags(size_t size, int flags) {
+	unsigned saved = thread_tag;
+	void	*ptr;
+
+	if (flags & ~(M_HOT | M_COLD | M_SHORT_LIVED) ||
+	    __builtin_popcount(flags) > 1) {
+		errno = EINVAL;
 		return NULL;
 	}
-
-	return internal_malloc(total_size);
+	if (flags == M_SHORT_LIVED) {
+		ptr = size - 1 < SHORT_MAX && malloc_init() ? short_malloc(size)
+							    : NULL;
+		if (ptr) {
+			prof_sample(__builtin_return_address(0), size);
+			check_heap();
+			limit_poll();
+			return ptr;
+		}
+	} else if (flags) {
+		thread_tag = flags & M_HOT ? TAG_HOT : TAG_COLD;
+	}
+	ptr = internal_malloc(size, __builtin_return_address(0));
+	thread_tag = saved;
+	check_heap();
+	limit_poll();
+	return ptr;
 }
 
-static Header *internal_realloc(Header *header, size_t size) {
-	Header *new = internal_malloc(size);
-	if (new == NULL) {
-		return NULL;
+/**
+ * Abort on pointers outside the reservation. With CHECK_HEAP, also abort on
+ * pointers that were not handed out by m_malloc or were already freed.
+ */
+static void check_pointer(void *ptr) {
+	if (!in_heap_region(ptr) && !in_large_region(ptr)) {
+		heap_error("free of a foreign pointer", ptr);
+	}
+
+#if CHECK_HEAP
+	int   valid;
+	Slab *slab = NULL;
+
+	if (in_heap_region(ptr)) {
+		Arena *arena = arena_of(ptr);
+		lock_acquire(&arena->lock);
+		valid = (char *)ptr < arena->end &&
+			mem_to_chunk(ptr)->size & CHUNK_INUSE;
+		lock_release(&arena->lock);
+	} else {
+		run_lock_acquire();
+		PageRun *run = &page_map[page_index(ptr)];
+		valid = page_index(ptr) < large_top && run->flags & RUN_INUSE;
+		if (valid && run->flags & RUN_SLAB) {
+			slab = run->slab;
+		} else if (valid && run->flags & RUN_SHORT) {
+			/* short_free poisons the size */
+			valid = ((size_t *)ptr)[-1] <= SHORT_MAX;
+		} else if ((uintptr_t)ptr & (page_size - 1)) {
+			valid = 0;
+		}
+		pthread_mutex_unlock(&run_lock);
 	}
 
-	size_t bytes = header->data.size < new->data.size ? header->data.size
-							  : new->data.size;
-	memcpy(new + 1, header + 1, bytes - sizeof(Header));
+	if (slab) {
+		CentralList *central = slab_central(slab);
 
-	internal_free(header);
+		lock_acquire(&central->lock);
+		slab = page_map[page_index(ptr)].slab; /* meshing moves pages */
+		uint32_t slot = slab_slot(slab, ptr);
+		valid = slot * slab->size == slab_offset(slab, ptr) &&
+			!(slab->bitmap[slot / 64] & (1UL << slot % 64));
+		lock_release(&central->lock);
+	}
 
-	return new;
+	if (!valid) {
+		heap_error("double free or invalid pointer", ptr);
+	}
+#endif
 }
 
-static void internal_free(Header *header) {
-	if (munmap(header, header->data.size) == -1) {
-		perror("munmap");
-		exit(EXIT_FAILURE);
-	};
+/**
+ * Number of bytes the caller may use in an allocated block.
+ */
+static size_t usable_size(void *ptr) {
+	if (in_large_region(ptr)) {
+		PageRun *run = &page_map[page_index(ptr)];
+		if (run->flags & RUN_SLAB) {
+			return size_classes[run_size_class(run)].size;
+		}
+		if (run->flags & RUN_SHORT) {
+			return ((size_t *)ptr)[-1];
+		}
+		return (size_t)run->npages << page_shift;
+	}
+	return chunk_size(mem_to_chunk(ptr)) - sizeof(Header);
+}
+
+/**
+ * Initialize on first use. Returns 0 if the address space could not be
+ * reserved.
+ */
+static inline int malloc_init(void) {
+	if (__atomic_load_n(&heap_start, __ATOMIC_ACQUIRE) == NULL) {
+		pthread_once(&init_once, region_init);
+		if (heap_start == NULL) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+static void *internal_malloc(size_t size, void *caller) {
+	if (size == 0) {
+		return NULL;
+	}
+	if (!malloc_init()) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if (__builtin_expect(thread_tag != 0, 0)) {
+		return tagged_malloc(size, thread_tag, caller);
+	}
+	if (__builtin_expect(life_active, 0)) {
+		void *ptr = life_malloc(size, caller);
+		if (ptr) {
+			return ptr;
+		}
+	}
+
+	if (size <= SMALL_MAX) {
+		return small_malloc(size, caller);
+	}
+
+	/* page multiples take exactly their pages, page-aligned, at any size */
+	void *ptr = NULL;
+	if (size <= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) &&
+	    size & (page_size - 1)) {
+		Arena  *arena = arena_lock();
+		Header *chunk = heap_malloc(arena, request_to_chunk_size(size));
+		int	refused = chunk && !charge_to(arena,
+						      chunk_size(chunk) -
+							  sizeof(Header),
+						      1);
+		if (refused) {
+			heap_free(arena, chunk);
+		} else {
+			ptr = chunk_to_mem(chunk);
+		}
+		lock_release(&arena->lock);
+		if (refused) {
+			return NULL;
+		}
+	}
+	/* above the threshold, a page multiple, or the arena's slice is full */
+	if (ptr == NULL) {
+		long bytes = size <= large_region_size
+				 ? (long)align_up(size, page_size)
+				 : 0;
+		if (!charge(bytes, 1)) {
+			return NULL;
+		}
+		run_lock_acquire();
+		ptr = large_malloc(size);
+		pthread_mutex_unlock(&run_lock);
+		if (ptr == NULL) {
+			charge(-bytes, 0);
+		} else {
+			charge_map_set(ptr, thread_arena);
+		}
+	}
+
+	if (ptr) {
+		prof_sample(caller, size);
+	}
+	return ptr;
+}
+
+static void *internal_calloc(size_t nmemb, size_t size, void *caller) {
+	size_t total_size = nmemb * size;
+	if (nmemb && total_size / nmemb != size) {
+		errno = EOVERFLOW;
+		return NULL;
+	}
+
+	void *ptr = internal_malloc(total_size, caller);
+	/* large runs are zero unless they were reused before being purged */
+	if (ptr != NULL && (!is_large_block(ptr) ||
+			    page_map[page_index(ptr)].flags & RUN_DIRTY)) {
+		memset(ptr, 0, total_size);
+	}
+
+	return ptr;
+}
+
+static void *internal_realloc(void *ptr, size_t size, void *caller) {
+	size_t	 old_size;
+	unsigned tag = 0;
+
+	check_pointer(ptr);
+
+	if (in_large_region(ptr)) {
+		PageRun *run = &page_map[page_index(ptr)];
+		tag = run_tag(run);
+		if (run->flags & RUN_SHORT) {
+			/* shrink in place, grow into another short block */
+			old_size = usable_size(ptr);
+			void *new = size <= old_size	 ? ptr
+				    : size <= SHORT_MAX ? short_malloc(size)
+							: NULL;
+			if (new != ptr && new) {
+				memcpy(new, ptr, old_size);
+				short_free(ptr);
+			}
+			if (new) {
+				return new;
+			}
+		} else if (run->flags & RUN_SLAB) {
+			if ((tag ? tag_slab_size(size) : size <= SMALL_MAX) &&
+			    tag_size_class(size) == run_size_class(run)) {
+				return ptr;
+			}
+		} else {
+			void *new = NULL;
+			/* tagged blocks and page multiples stay in page
+			 * runs */
+			if ((size > __atomic_load_n(&mmap_threshold,
+						    __ATOMIC_RELAXED) ||
+			     (tag && !tag_slab_size(size)) ||
+			     !(size & (page_size - 1))) &&
+			    size <= large_region_size) {
+				/* the run is ours, its length cannot change;
+				 * it stays charged to its arena */
+				Arena *arena = charge_map_arena(ptr);
+				long delta = (long)align_up(size, page_size) -
+					     ((long)run->npages << page_shift);
+				if (delta > 0 && !charge_to(arena, delta, 1)) {
+					return NULL;
+				}
+				run_lock_acquire();
+				new = large_realloc(ptr, size);
+				pthread_mutex_unlock(&run_lock);
+				if (new ? delta < 0 : delta > 0) {
+					charge_to(arena, -delta, 0);
+				}
+				if (new) {
+					charge_map_set(new, arena);
+				}
+				if (new && tag) {
+					__atomic_fetch_add(
+					    &tag_stats[tag].allocated, delta,
+					    __ATOMIC_RELAXED);
+				}
+			}
+			if (new) {
+				return new;
+			}
+		}
+		old_size = usable_size(ptr);
+	} else {
+		/* neighbours flip flag bits in the header, read it locked */
+		Arena *arena = arena_of(ptr);
+		int    resized = 0;
+		lock_acquire(&arena->lock);
+		old_size = usable_size(ptr);
+		if (size <= __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) &&
+		    size & (page_size - 1)) {
+			/* charge growth up front, settle on the exact size */
+			size_t want = request_to_chunk_size(size) - sizeof(Header);
+			long   growth = want > old_size ? want - old_size : 0;
+
+			int charged =
+			    growth == 0 || charge_to(arena, growth, 1);
+
+			resized = charged &&
+				  heap_resize(arena, mem_to_chunk(ptr),
+					      request_to_chunk_size(size));
+			if (resized) {
+				charge_to(arena,
+					  (long)usable_size(ptr) -
+					      (long)(old_size + growth),
+					  0);
+			} else if (charged) {
+				charge_to(arena, -growth, 0);
+			}
+		}
+		lock_release(&arena->lock);
+		if (resized) {
+			return ptr;
+		}
+	}
+
+	/* the block keeps its tag, but its lifetime is predicted anew */
+	if (tag == TAG_SAMPLED || tag == TAG_LONG) {
+		tag = 0;
+	}
+	unsigned saved = thread_tag;
+	thread_tag = tag;
+	void *new = internal_malloc(size, caller);
+	thread_tag = saved;
+	if (new == NULL) {
+		return NULL;
+	}
+
+	memcpy(new, ptr, old_size < size ? old_size : size);
+
+	internal_free(ptr);
+
+	return new;
+}
+
+static void internal_free(void *ptr) {
+	check_pointer(ptr);
+
+	if (in_heap_region(ptr)) {
+		Arena *arena = arena_of(ptr);
+		lock_acquire(&arena->lock);
+		charge_to(arena, -(long)usable_size(ptr), 0);
+		heap_free(arena, mem_to_chunk(ptr));
+		lock_release(&arena->lock);
+	} else if (page_map[page_index(ptr)].flags & RUN_SHORT) {
+		short_free(ptr);
+	} else if (page_map[page_index(ptr)].flags & RUN_TAG_MASK) {
+		tagged_free(ptr, page_map[page_index(ptr)].flags);
+	} else if (page_map[page_index(ptr)].flags & RUN_SLAB) {
+		small_free(run_size_class(&page_map[page_index(ptr)]), ptr);
+	} else {
+		charge_to(charge_map_arena(ptr),
+			  -((long)page_map[page_index(ptr)].npages << page_shift),
+			  0);
+		run_lock_acquire();
+		large_free(ptr);
+		pthread_mutex_unlock(&run_lock);
+	}
+}
+
+/**
+ * Make pages readable and writable.
+ */
+static int pages_commit(void *addr, size_t len) {
+	/* real-time mode allocates from what it has */
+	if (__atomic_load_n(&realtime, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+	return mprotect(addr, len, PROT_READ | PROT_WRITE) == 0;
+}
+
+/**
+ * Return pages and their commit charge to the kernel, leaving the address
+ * range reserved.
+ */
+static void pages_decommit(void *addr, size_t len) {
+	if (mmap(addr, len, PROT_NONE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE, -1,
+		 0) == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+	pages_thp(addr, len);
+}
+
+/**
+ * Apply the configured transparent huge page mode to a fresh mapping.
+ */
+static void pages_thp(void *addr, size_t len) {
+	if (opt_thp == THP_ALWAYS) {
+		madvise(addr, len, MADV_HUGEPAGE);
+	} else if (opt_thp == THP_NEVER) {
+		madvise(addr, len, MADV_NOHUGEPAGE);
+	}
+}
+
+/**
+ * Return the physical pages to the kernel, keeping them committed. They read
+ * back as zero.
+ */
+static void pages_purge(void *addr, size_t len) {
+	madvise(addr, len, MADV_DONTNEED);
+}
+
+/**
+ * Fault committed pages in, so that their first use takes no page fault.
+ */
+static void pages_prefault(void *addr, size_t len) {
+#ifdef MADV_POPULATE_WRITE
+	if (madvise(addr, len, MADV_POPULATE_WRITE) == 0) {
+		return;
+	}
+#endif
+	/* before Linux 5.14: touch every page, keeping its contents */
+	for (size_t offset = 0; offset < len; offset += page_size) {
+		volatile char *byte = (char *)addr + offset;
+		*byte = *byte;
+	}
+}
+
+/**
+ * Lay out the slabs of each size class: the fewest pages (up to
+ * SLAB_PAGES_MAX) that waste no more than 1/16 of the slab, with at most
+ * SLAB_SLOTS objects.
+ */
+static void size_classes_init(void) {
+	for (unsigned i = 0, size = 0, tag_size = SMALL_MAX + 256;
+	     i < TAG_CLASSES; i++) {
+		SizeClass *class = &size_classes[i];
+
+		uint32_t npages = 1;
+		uint32_t slots;
+		for (;; npages++) {
+			size_t bytes = (size_t)npages << page_shift;
+			slots = bytes / class->size;
+			slots = slots < SLAB_SLOTS ? slots : SLAB_SLOTS;
+			if (npages == SLAB_PAGES_MAX ||
+			    (bytes - slots * class->size) * 16 <= bytes) {
+				break;
+			}
+		}
+		class->npages = npages;
+		class->slots = slots;
+		class->div_magic = (1UL << 32) / class->size + 1;
+		class->offset_mask = npages == 1 ? page_size - 1 : ~0UL;
+
+		for (; i < NUM_CLASSES && size <= class->size; size += 16) {
+			size_class_index[size / 16] = i;
+		}
+		for (; i >= NUM_CLASSES && tag_size <= class->size;
+		     tag_size += 256) {
+			tag_class_index[tag_size / 256] = i;
+		}
+	}
+}
+
+static int conf_match(const char *str, size_t len, const char *word) {
+	return strlen(word) == len && memcmp(str, word, len) == 0;
+}
+
+static int conf_choice(const char *value, size_t len, const char *const *words,
+		       unsigned nwords, unsigned *opt) {
+	for (unsigned i = 0; i < nwords; i++) {
+		if (conf_match(value, len, words[i])) {
+			*opt = i;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static int conf_number(const char *value, size_t len, long min, long max,
+		       long *opt) {
+	char *end;
+	long  n = strtol(value, &end, 10);
+
+	if (len == 0 || end != value + len || n < min || n > max) {
+		return 0;
+	}
+	*opt = n;
+	return 1;
+}
+
+/**
+ * Apply one M_MALLOC_CONF option. Returns 0 if the key or value is invalid.
+ */
+static int conf_set(const char *key, size_t key_len, const char *value,
+		    size_t value_len) {
+	static const char *const engines[] = {"hybrid", "heap", "runs"};
+	static const char *const thp_modes[] = {"default", "always", "never"};
+	static const char *const bools[] = {"false", "true"};
+	long			 n;
+
+	if (conf_match(key, key_len, "engine")) {
+		return conf_choice(value, value_len, engines, 3, &opt_engine);
+	} else if (conf_match(key, key_len, "tcache_max")) {
+		if (!conf_number(value, value_len, 1, CACHE_SLOTS, &n)) {
+			return 0;
+		}
+		opt_tcache_max = n;
+		return 1;
+	} else if (conf_match(key, key_len, "decay_ms")) {
+		return conf_number(value, value_len, -1, LONG_MAX,
+				   &opt_decay_ms);
+	} else if (conf_match(key, key_len, "thp")) {
+		return conf_choice(value, value_len, thp_modes, 3, &opt_thp);
+	} else if (conf_match(key, key_len, "narenas")) {
+		if (!conf_number(value, value_len, 1, MAX_ARENAS, &n)) {
+			return 0;
+		}
+		opt_narenas = n;
+		return 1;
+	} else if (conf_match(key, key_len, "prof")) {
+		return conf_choice(value, value_len, bools, 2, &opt_prof);
+	} else if (conf_match(key, key_len, "stats_print")) {
+		return conf_choice(value, value_len, bools, 2, &opt_stats_print);
+	} else if (conf_match(key, key_len, "background_thread")) {
+		return conf_choice(value, value_len, bools, 2,
+				   &opt_background_thread);
+	} else if (conf_match(key, key_len, "background_interval_ms")) {
+		return conf_number(value, value_len, 1, INT_MAX,
+				   &opt_background_interval_ms);
+	} else if (conf_match(key, key_len, "prewarm_small")) {
+		if (!conf_number(value, value_len, 0, LONG_MAX, &n)) {
+			return 0;
+		}
+		opt_prewarm_small = n;
+		return 1;
+	} else if (conf_match(key, key_len, "prewarm_large")) {
+		if (!conf_number(value, value_len, 0, LONG_MAX, &n)) {
+			return 0;
+		}
+		opt_prewarm_large = n;
+		return 1;
+	} else if (conf_match(key, key_len, "realtime")) {
+		return conf_choice(value, value_len, bools, 2, &opt_realtime);
+	} else if (conf_match(key, key_len, "soft_limit")) {
+		if (!conf_number(value, value_len, 0, LONG_MAX, &n)) {
+			return 0;
+		}
+		opt_soft_limit = n;
+		return 1;
+	} else if (conf_match(key, key_len, "hard_limit")) {
+		if (!conf_number(value, value_len, 0, LONG_MAX, &n)) {
+			return 0;
+		}
+		opt_hard_limit = n;
+		return 1;
+	} else if (conf_match(key, key_len, "cgroup")) {
+		return conf_choice(value, value_len, bools, 2, &opt_cgroup);
+	} else if (conf_match(key, key_len, "lifetime")) {
+		return conf_choice(value, value_len, bools, 2, &opt_lifetime);
+	}
+	return 0;
+}
+
+/**
+ * Read M_MALLOC_CONF, e.g. "engine:runs,tcache_max:16,decay_ms:1000". Runs
+ * before anything is allocated, so the string is scanned in place and never
+ * copied. Invalid options are reported and skipped.
+ */
+static void conf_init(void) {
+	const char *conf = getenv("M_MALLOC_CONF");
+
+	while (conf && *conf) {
+		const char *key = conf;
+		size_t	    key_len = strcspn(key, ":,");
+		const char *value = key + key_len + (key[key_len] == ':');
+		size_t	    value_len = key[key_len] == ':' ? strcspn(value, ",")
+							: 0;
+
+		conf = value + value_len + (value[value_len] == ',');
+		if (!conf_set(key, key_len, value, value_len)) {
+			fprintf(stderr,
+				"m_malloc: invalid M_MALLOC_CONF option %.*s\n",
+				(int)(value + value_len - key), key);
+		}
+	}
+}
+
+/**
+ * Reserve the address space for the page map, the heap region and the large
+ * region. Only the epilogue header of each arena is committed up front.
+ * heap_start is published last and stays NULL on failure.
+ */
+static void region_init(void) {
+	pthread_once(&conf_once, conf_init);
+	page_size = sysconf(_SC_PAGESIZE);
+	page_shift = __builtin_ctzl(page_size);
+	long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	if (opt_narenas == 0) {
+		opt_narenas = ncpus < 1		 ? 1
+			      : ncpus > MAX_ARENAS ? MAX_ARENAS
+						   : ncpus;
+	}
+	if (ncpus <= 1) {
+		/* the holder cannot run while we spin */
+		lock_spin_max = 0;
+	}
+
+	size_t reserve = RESERVE_SIZE;
+	void  *base = MAP_FAILED;
+	for (; base == MAP_FAILED && reserve >= RESERVE_SIZE_MIN; reserve /= 2) {
+		base = mmap(NULL, reserve, PROT_NONE,
+			    MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	}
+	if (base == MAP_FAILED) {
+		return;
+	}
+	reserve *= 2;
+	pages_thp(base, reserve);
+
+	/* a quarter for the heap, the rest for page runs, their page map and
+	 * their charge map */
+	heap_region_size = reserve / 4;
+	size_t large_pages =
+	    (reserve - heap_region_size) /
+	    (page_size + sizeof(PageRun) + page_size / ALIGNMENT);
+	size_t map_size = align_up(large_pages * sizeof(PageRun), page_size);
+	size_t charge_size =
+	    align_up(large_pages * (page_size / ALIGNMENT), page_size);
+
+	char *start = (char *)base + map_size + charge_size;
+	if (pthread_key_create(&thread_cache_key, thread_cache_destroy) ||
+	    pthread_key_create(&arena_key, arena_detach) ||
+	    pthread_key_create(&short_key, short_detach)) {
+		munmap(base, reserve);
+		return;
+	}
+
+	page_map = base;
+	charge_map = (uint8_t *)base + map_size;
+	large_start = start + heap_region_size;
+	large_region_size = (large_pages - (map_size + charge_size) / page_size)
+			    << page_shift;
+
+	/* arena slices are a power of two, the rest of the heap region is
+	 * left unused */
+	arena_shift = 63 - __builtin_clzl(heap_region_size / opt_narenas);
+	heap_region_size = (size_t)opt_narenas << arena_shift;
+
+	if (opt_engine == ENGINE_HEAP) {
+		mmap_threshold = MMAP_THRESHOLD_MAX;
+	} else if (opt_engine == ENGINE_RUNS) {
+		mmap_threshold = SMALL_MAX;
+	}
+
+	for (int i = 0; i < RUN_BINS; i++) {
+		run_bins[i] = RUN_NIL;
+	}
+	decay_ms = opt_decay_ms;
+#if MESHING
+	mesh_init();
+#endif
+
+	arenas = meta_alloc(opt_narenas * sizeof(Arena));
+	transfer_caches = meta_alloc(NUM_CLASSES * sizeof(TransferCache));
+	central_lists = meta_alloc(NUM_CLASSES * sizeof(CentralList));
+	prof_sites = meta_alloc(PROF_SITES * sizeof(ProfSite));
+	if (!arenas || !transfer_caches || !central_lists || !prof_sites) {
+		munmap(base, reserve);
+		return;
+	}
+	for (unsigned i = 0; i < opt_narenas; i++) {
+		Arena *arena = &arenas[i];
+		arena->start = start + ((size_t)i << arena_shift);
+		arena->limit = arena->start + ((size_t)1 << arena_shift);
+		if (!pages_commit(arena->start, page_size)) {
+			munmap(base, reserve);
+			return;
+		}
+		arena->committed = arena->start + page_size;
+
+		Header *epilogue = (Header *)arena->start;
+		epilogue->size = CHUNK_INUSE | CHUNK_PREV_INUSE;
+		arena->end = (char *)(epilogue + 1);
+		lock_init(&arena->lock);
+	}
+	for (int i = 0; i < NUM_CLASSES; i++) {
+		lock_init(&transfer_caches[i].lock);
+		lock_init(&central_lists[i].lock);
+		central_lists[i].nempty_max = EMPTY_SLABS_MAX;
+	}
+
+	size_classes_init();
+	pthread_atfork(fork_prepare, fork_parent, fork_child);
+	prof_active = opt_prof;
+	if (opt_lifetime) {
+		life_sites = meta_alloc(PROF_SITES * sizeof(ProfSite));
+		life_active = life_sites != NULL;
+	}
+	limit_soft = opt_soft_limit;
+	limit_hard = opt_hard_limit;
+	if (opt_cgroup) {
+		cgroup_init();
+	}
+	if (opt_stats_print) {
+		atexit(m_malloc_stats_print);
+	}
+
+	__atomic_store_n(&heap_start, start, __ATOMIC_RELEASE);
+	if (opt_background_thread) {
+		background_set(1);
+	}
+}
+
+/**
+ * Push a chunk onto its arena's free list.
+ */
+static void free_list_insert(Arena *arena, Header *chunk) {
+	FreeChunk *free_chunk = (FreeChunk *)chunk;
+	free_chunk->prev = NULL;
+	free_chunk->next = arena->free_list;
+	if (arena->free_list) {
+		arena->free_list->prev = free_chunk;
+	}
+	arena->free_list = free_chunk;
+}
+
+/**
+ * Unlink a chunk from the free list.
+ */
+static void free_list_remove(Arena *arena, Header *chunk) {
+	FreeChunk *free_chunk = (FreeChunk *)chunk;
+	if (free_chunk->prev) {
+		free_chunk->prev->next = free_chunk->next;
+	} else {
+		arena->free_list = free_chunk->next;
+	}
+	if (free_chunk->next) {
+		free_chunk->next->prev = free_chunk->prev;
+	}
+}
+
+/**
+ * Mark a chunk free, merge it with its free neighbours and put the result on
+ * the free list.
+ */
+static Header *coalesce(Arena *arena, Header *chunk) {
+	size_t	size = chunk_size(chunk);
+	Header *next = next_chunk(chunk);
+
+	if (!(next->size & CHUNK_INUSE)) {
+		free_list_remove(arena, next);
+		size += chunk_size(next);
+	}
+	if (!(chunk->size & CHUNK_PREV_INUSE)) {
+		chunk = prev_chunk(chunk);
+		free_list_remove(arena, chunk);
+		size += chunk_size(chunk);
+	}
+
+	/* no two free chunks are ever adjacent, so the previous one is used */
+	chunk->size = size | CHUNK_PREV_INUSE;
+	next = next_chunk(chunk);
+	next->prev_size = size;
+	next->size &= ~CHUNK_PREV_INUSE;
+
+	free_list_insert(arena, chunk);
+	return chunk;
+}
+
+/**
+ * Grow an arena's heap by at least size bytes, committing pages as needed,
+ * and return the new space as a free chunk. The old epilogue becomes the new
+ * chunk's header.
+ */
+static Header *heap_extend(Arena *arena, size_t size) {
+	size_t increment = size < HEAP_INCREMENT ? HEAP_INCREMENT : size;
+
+	if (increment > (size_t)(arena->limit - arena->end)) {
+		return NULL;
+	}
+
+	char *committed = (char *)align_up((uintptr_t)arena->end + increment,
+					   page_size);
+	if (committed > arena->committed) {
+		if (!pages_commit(arena->committed,
+				  committed - arena->committed)) {
+			return NULL;
+		}
+		arena->committed = committed;
+	}
+
+	Header *chunk = (Header *)arena->end - 1;
+	chunk->size = increment | CHUNK_INUSE | (chunk->size & CHUNK_PREV_INUSE);
+	arena->end += increment;
+
+	Header *epilogue = next_chunk(chunk);
+	epilogue->prev_size = 0;
+	epilogue->size = CHUNK_INUSE | CHUNK_PREV_INUSE;
+
+	return coalesce(arena, chunk);
+}
+
+/**
+ * Decommit the top of an arena if the free chunk at its end grew past
+ * threshold, keeping HEAP_INCREMENT.
+ */
+static void heap_trim(Arena *arena, Header *chunk, size_t threshold) {
+	size_t	size = chunk_size(chunk);
+	Header *epilogue = (Header *)arena->end - 1;
+
+	if (size < threshold || size <= HEAP_INCREMENT ||
+	    next_chunk(chunk) != epilogue) {
+		return;
+	}
+
+	size_t release = size - HEAP_INCREMENT;
+	arena->end -= release;
+	size -= release;
+	chunk->size = size | (chunk->size & CHUNK_FLAGS);
+	epilogue = (Header *)arena->end - 1;
+	epilogue->prev_size = size;
+	epilogue->size = CHUNK_INUSE;
+
+	char *committed = (char *)align_up((uintptr_t)arena->end, page_size);
+	if (committed < arena->committed) {
+		pages_decommit(committed, arena->committed - committed);
+		arena->committed = committed;
+	}
+}
+
+static Header *heap_malloc(Arena *arena, size_t size) {
+	FreeChunk *free_chunk = arena->free_list;
+	while (free_chunk && chunk_size(&free_chunk->header) < size) {
+		free_chunk = free_chunk->next;
+	}
+
+	Header *chunk = free_chunk ? &free_chunk->header
+				   : heap_extend(arena, size);
+	if (chunk == NULL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	free_list_remove(arena, chunk);
+
+	size_t chunk_bytes = chunk_size(chunk);
+	if (chunk_bytes - size >= MIN_CHUNK_SIZE) {
+		/* split, the tail stays free */
+		Header *rest = (Header *)((char *)chunk + size);
+		rest->size = (chunk_bytes - size) | CHUNK_PREV_INUSE;
+		next_chunk(rest)->prev_size = chunk_bytes - size;
+		free_list_insert(arena, rest);
+		chunk_bytes = size;
+	} else {
+		next_chunk(chunk)->size |= CHUNK_PREV_INUSE;
+	}
+
+	chunk->size = chunk_bytes | CHUNK_INUSE | (chunk->size & CHUNK_FLAGS);
+	arena->allocated += chunk_bytes;
+	return chunk;
+}
+
+/**
+ * Resize a chunk in place, absorbing the next chunk if it is free. Returns 0
+ * if there is no room.
+ */
+static int heap_resize(Arena *arena, Header *chunk, size_t size) {
+	size_t	old_size = chunk_size(chunk);
+	Header *next = next_chunk(chunk);
+
+	if (size > old_size && !(next->size & CHUNK_INUSE) &&
+	    old_size + chunk_size(next) >= size) {
+		free_list_remove(arena, next);
+		old_size += chunk_size(next);
+		arena->allocated += chunk_size(next);
+		chunk->size = old_size | (chunk->size & CHUNK_FLAGS);
+		next_chunk(chunk)->size |= CHUNK_PREV_INUSE;
+	}
+	if (size > old_size) {
+		return 0;
+	}
+
+	/* hand the tail back to the heap */
+	if (old_size - size >= MIN_CHUNK_SIZE) {
+		Header *rest = (Header *)((char *)chunk + size);
+		rest->size = (old_size - size) | CHUNK_INUSE | CHUNK_PREV_INUSE;
+		chunk->size = size | (chunk->size & CHUNK_FLAGS);
+		heap_free(arena, rest);
+	}
+	return 1;
+}
+
+static void heap_free(Arena *arena, Header *chunk) {
+	arena->allocated -= chunk_size(chunk);
+	heap_trim(arena, coalesce(arena, chunk),
+		  __atomic_load_n(&cgroup_pressure, __ATOMIC_RELAXED)
+		      ? 0
+		      : __atomic_load_n(&trim_threshold, __ATOMIC_RELAXED));
+}
+
+/**
+ * Give the calling thread the next arena, round-robin.
+ */
+static Arena *arena_assign(void) {
+	unsigned i = __atomic_fetch_add(&arena_next, 1, __ATOMIC_RELAXED);
+	Arena	*arena = &arenas[i % opt_narenas];
+
+	__atomic_fetch_add(&arena->nthreads, 1, __ATOMIC_RELAXED);
+	pthread_setspecific(arena_key, arena);
+	thread_arena = arena;
+	return arena;
+}
+
+/**
+ * Add the calling thread's pending charge with an arena to it and the
+ * process.
+ */
+static void charge_flush(Arena *arena) {
+	long pending = thread_charges[arena - arenas];
+
+	thread_charges[arena - arenas] = 0;
+	__atomic_add_fetch(&arena->charged, pending, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&charged_total, pending, __ATOMIC_RELAXED);
+}
+
+/**
+ * Move the calling thread from one arena to another. Its pending charge is
+ * settled with the old one.
+ */
+static void arena_move(Arena *from, Arena *to) {
+	charge_flush(from);
+	__atomic_fetch_sub(&from->nthreads, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&to->nthreads, 1, __ATOMIC_RELAXED);
+	pthread_setspecific(arena_key, to);
+	thread_arena = to;
+}
+
+/**
+ * Lock the calling thread's arena. If another thread holds it, move to the
+ * least loaded arena whose lock is free, and only block if there is none or
+ * the thread was bound to its arena.
+ */
+static Arena *arena_lock(void) {
+	Arena *arena = thread_arena;
+
+	if (__builtin_expect(!arena, 0)) {
+		arena = arena_assign();
+	}
+	if (lock_try(&arena->lock)) {
+		return arena;
+	}
+	if (thread_arena_bound) {
+		lock_acquire(&arena->lock);
+		return arena;
+	}
+
+	Arena	*best = NULL;
+	unsigned load = __atomic_load_n(&arena->nthreads, __ATOMIC_RELAXED);
+	for (unsigned i = 0; i < opt_narenas; i++) {
+		unsigned n =
+		    __atomic_load_n(&arenas[i].nthreads, __ATOMIC_RELAXED);
+		if (n < load && lock_try(&arenas[i].lock)) {
+			if (best) {
+				lock_release(&best->lock);
+			}
+			best = &arenas[i];
+			load = n;
+		}
+	}
+	if (best == NULL) {
+		lock_acquire(&arena->lock);
+		return arena;
+	}
+
+	arena_move(arena, best);
+	return best;
+}
+
+/**
+ * pthread key destructor: an exiting thread no longer loads its arena and
+ * settles its pending charges, with every arena.
+ */
+static void arena_detach(void *arg) {
+	Arena *arena = arg;
+
+	for (unsigned i = 0; i < opt_narenas; i++) {
+		if (thread_charges[i]) {
+			charge_flush(&arenas[i]);
+		}
+	}
+	__atomic_fetch_sub(&arena->nthreads, 1, __ATOMIC_RELAXED);
+	thread_arena = NULL;
+}
+
+/**
+ * Tell the kernel that the pages of cold slabs and blocks will not be used
+ * soon, so that it reclaims them before any other (MADV_COLD), or, with
+ * pageout, at once (MADV_PAGEOUT). Their contents are kept. Needs Linux 5.4.
+ */
+static void cold_advise(int pageout) {
+#ifdef MADV_COLD
+	int advice = MADV_COLD;
+#ifdef MADV_PAGEOUT
+	if (pageout) {
+		advice = MADV_PAGEOUT;
+	}
+#endif
+	/* one call per stretch of cold runs */
+	uint32_t start = 0;
+	run_lock_acquire();
+	for (uint32_t page = 0; page < large_top;
+	     page += page_map[page].npages) {
+		if ((run_flags(page) & RUN_TAG_MASK) >> RUN_TAG_SHIFT !=
+		    TAG_COLD) {
+			if (start < page) {
+				madvise(page_addr(start),
+					(size_t)(page - start) << page_shift,
+					advice);
+			}
+			start = page + page_map[page].npages;
+		}
+	}
+	if (start < large_top) {
+		madvise(page_addr(start), (size_t)(large_top - start)
+					      << page_shift,
+			advice);
+	}
+	pthread_mutex_unlock(&run_lock);
+#else
+	(void)pageout;
+#endif
+}
+
+/**
+ * Purge as much as possible at once: everything purge_all gives back and
+ * every thread's cached objects. Cold pages are paged out under cgroup
+ * pressure, marked cold otherwise.
+ */
+static void purge_now(void) {
+	thread_caches_steal(0);
+	thread_cache_flush(thread_cache);
+	purge_all();
+	cold_advise(__atomic_load_n(&cgroup_pressure, __ATOMIC_RELAXED));
+}
+
+/**
+ * Open a file of the calling process's cgroup v2, found through
+ * /proc/self/cgroup under the unified or the hybrid mount point. Runs at
+ * init, so nothing is allocated. Returns -1 if there is no such file.
+ */
+static int cgroup_open(const char *name, int flags) {
+	static const char *const mounts[] = {"/sys/fs/cgroup",
+					     "/sys/fs/cgroup/unified"};
+	char			 line[PATH_MAX], path[PATH_MAX];
+	int			 fd = open("/proc/self/cgroup", O_RDONLY | O_CLOEXEC);
+	ssize_t			 len = fd < 0 ? -1 : read(fd, line, sizeof(line) - 1);
+
+	if (fd >= 0) {
+		close(fd);
+	}
+	if (len <= 0) {
+		return -1;
+	}
+	line[len] = '\0';
+
+	/* the v2 entry is "0::/path" */
+	char *dir = strstr(line, "0::/");
+	if (dir == NULL || (dir != line && dir[-1] != '\n')) {
+		return -1;
+	}
+	dir += 3;
+	dir[strcspn(dir, "\n")] = '\0';
+	if (strcmp(dir, "/") == 0) {
+		dir = "";
+	}
+
+	fd = -1;
+	for (unsigned i = 0; fd < 0 && i < 2; i++) {
+		if (snprintf(path, sizeof(path), "%s%s/%s", mounts[i], dir,
+			     name) < (int)sizeof(path)) {
+			fd = open(path, flags | O_CLOEXEC);
+		}
+	}
+	return fd;
+}
+
+/**
+ * Read a number from a cgroup file, 0 for "max" or on error.
+ */
+static uint64_t cgroup_read(int fd) {
+	char	buf[32];
+	ssize_t len = fd < 0 ? -1 : pread(fd, buf, sizeof(buf) - 1, 0);
+
+	if (len <= 0) {
+		return 0;
+	}
+	buf[len] = '\0';
+	return strtoull(buf, NULL, 10);
+}
+
+/**
+ * Find the cgroup's memory.max and memory.current, and ask memory.pressure
+ * for a PSI event when memory stalls pile up. Either is enough to go on.
+ */
+static void cgroup_init(void) {
+	cgroup_max_fd = cgroup_open("memory.max", O_RDONLY);
+	cgroup_current_fd = cgroup_open("memory.current", O_RDONLY);
+	if (cgroup_max_fd < 0 || cgroup_current_fd < 0) {
+		if (cgroup_max_fd >= 0) {
+			close(cgroup_max_fd);
+		}
+		if (cgroup_current_fd >= 0) {
+			close(cgroup_current_fd);
+		}
+		cgroup_max_fd = cgroup_current_fd = -1;
+	}
+
+	/* triggers need write access, which a container may not give */
+	cgroup_psi_fd = cgroup_open("memory.pressure", O_RDWR | O_NONBLOCK);
+	if (cgroup_psi_fd >= 0 &&
+	    write(cgroup_psi_fd, CGROUP_PSI, sizeof(CGROUP_PSI)) < 0) {
+		close(cgroup_psi_fd);
+		cgroup_psi_fd = -1;
+	}
+	cgroup_polled = now_ms();
+}
+
+/**
+ * Check the cgroup's usage against memory.max and look for a PSI event. Near
+ * the limit, or under pressure, purge everything and make frees purge at
+ * once; relax once usage is back under CGROUP_LOW eighths of the limit, or,
+ * without one, once the pressure is gone.
+ */
+static void cgroup_poll(void) {
+	if (realtime) {
+		return;
+	}
+
+	uint64_t max = cgroup_read(cgroup_max_fd);
+	uint64_t current = cgroup_read(cgroup_current_fd);
+	int	 stalled = 0;
+	if (cgroup_psi_fd >= 0) {
+		struct pollfd pfd = {cgroup_psi_fd, POLLPRI, 0};
+		stalled = poll(&pfd, 1, 0) > 0 && pfd.revents & POLLPRI;
+	}
+
+	if (stalled || (max && current > max / 8 * CGROUP_HIGH)) {
+		__atomic_store_n(&cgroup_pressure, 1, __ATOMIC_RELAXED);
+		purge_now();
+	} else if (!max || current < max / 8 * CGROUP_LOW) {
+		__atomic_store_n(&cgroup_pressure, 0, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Note the limits that the counts just crossed, upwards, for limit_handle to
+ * act on once no lock is held. Past the soft limit the process purges, at
+ * most every LIMIT_PURGE_MS; the hook is called on crossing the soft limit,
+ * or 7/8 of the hard limit if there is no soft one, and 7/8 of the arena's
+ * quota.
+ */
+static void limit_update(Arena *arena, long charged, long total) {
+	size_t soft = __atomic_load_n(&limit_soft, __ATOMIC_RELAXED);
+	size_t hard = __atomic_load_n(&limit_hard, __ATOMIC_RELAXED);
+	size_t quota = __atomic_load_n(&arena->quota, __ATOMIC_RELAXED);
+	size_t warn = soft ? soft : hard - hard / 8;
+	int    near = warn && total > (long)warn;
+
+	if (near != __atomic_load_n(&limit_near, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&limit_near, near, __ATOMIC_RELAXED) != near &&
+	    near) {
+		thread_limit_events |= LIMIT_NEAR;
+	}
+	if (soft && total > (long)soft) {
+		uint64_t now = now_ms();
+		uint64_t last = __atomic_load_n(&limit_purged, __ATOMIC_RELAXED);
+		if (now - last >= LIMIT_PURGE_MS &&
+		    __atomic_compare_exchange_n(&limit_purged, &last, now, 0,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED)) {
+			thread_limit_events |= LIMIT_PURGE;
+		}
+	}
+
+	/* the background thread polls the cgroup when it runs */
+	if ((cgroup_current_fd >= 0 || cgroup_psi_fd >= 0) &&
+	    !__atomic_load_n(&background_active, __ATOMIC_RELAXED)) {
+		uint64_t now = now_ms();
+		uint64_t last = __atomic_load_n(&cgroup_polled, __ATOMIC_RELAXED);
+		if (now - last >= CGROUP_POLL_MS &&
+		    __atomic_compare_exchange_n(&cgroup_polled, &last, now, 0,
+						__ATOMIC_RELAXED,
+						__ATOMIC_RELAXED)) {
+			thread_limit_events |= LIMIT_CGROUP;
+		}
+	}
+
+	near = quota && charged > (long)(quota - quota / 8);
+	if (near != __atomic_load_n(&arena->near_quota, __ATOMIC_RELAXED) &&
+	    __atomic_exchange_n(&arena->near_quota, near, __ATOMIC_RELAXED) !=
+		near &&
+	    near) {
+		thread_limit_events |= LIMIT_QUOTA;
+		thread_quota_arena = arena;
+	}
+}
+
+/**
+ * Settle a charge with an arena that reached CHARGE_BATCH either way, or any
+ * charge of a thread that has no arena (any more). A positive one that may
+ * fail is refused, leaving nothing charged, if it would take the process past
+ * the hard limit or the arena past its quota.
+ */
+static __attribute__((noinline)) int charge_slow(Arena *arena, long pending,
+						 int may_fail) {
+	if (may_fail && pending > 0) {
+		size_t hard = __atomic_load_n(&limit_hard, __ATOMIC_RELAXED);
+		size_t quota = __atomic_load_n(&arena->quota, __ATOMIC_RELAXED);
+		long   total = __atomic_load_n(&charged_total, __ATOMIC_RELAXED);
+		long charged = __atomic_load_n(&arena->charged, __ATOMIC_RELAXED);
+
+		if ((hard && total + pending > (long)hard) ||
+		    (quota && charged + pending > (long)quota)) {
+			errno = ENOMEM;
+			return 0;
+		}
+	}
+
+	thread_charges[arena - arenas] = 0;
+	limit_update(arena,
+		     __atomic_add_fetch(&arena->charged, pending,
+					__ATOMIC_RELAXED),
+		     __atomic_add_fetch(&charged_total, pending,
+					__ATOMIC_RELAXED));
+	return 1;
+}
+
+/**
+ * Charge bytes to an arena and the process, or credit them if negative. A
+ * thread adds its charges up per arena and only settles them, and checks the
+ * limits, once they reach CHARGE_BATCH, so limits hold to within that much
+ * per thread and arena and the fast paths touch no shared line. Returns 0
+ * with errno set to ENOMEM if may_fail and a limit refuses the charge. Never
+ * takes a lock.
+ */
+static inline int charge_to(Arena *arena, long bytes, int may_fail) {
+	long pending = thread_charges[arena - arenas] + bytes;
+
+	if (__builtin_expect(pending < CHARGE_BATCH && pending > -CHARGE_BATCH &&
+				 thread_arena != NULL,
+			     1)) {
+		thread_charges[arena - arenas] = pending;
+		return 1;
+	}
+	return charge_slow(arena, pending, may_fail);
+}
+
+/**
+ * Charge bytes to the calling thread's arena. Blocks in the large region note
+ * it in the charge map, with charge_map_set, so that frees credit it.
+ */
+static inline int charge(long bytes, int may_fail) {
+	return charge_to(thread_arena ? thread_arena : arena_assign(), bytes,
+			 may_fail);
+}
+
+static inline void charge_map_set(void *ptr, Arena *arena) {
+	charge_map[((char *)ptr - large_start) / ALIGNMENT] = arena - arenas;
+}
+
+/**
+ * The arena a block in the large region was charged to.
+ */
+static inline Arena *charge_map_arena(void *ptr) {
+	return &arenas[charge_map[((char *)ptr - large_start) / ALIGNMENT]];
+}
+
+/**
+ * Act on the limits the calling thread's charges crossed: purge past the
+ * soft limit, poll the cgroup, then call the hook.
+ */
+static void limit_handle(void) {
+	unsigned       events = thread_limit_events;
+	m_limit_hook_t hook = __atomic_load_n(&limit_hook, __ATOMIC_ACQUIRE);
+
+	/* the hook may allocate, and cross limits again */
+	thread_limit_events = 0;
+	if (events & LIMIT_PURGE && !realtime) {
+		purge_now();
+	}
+	if (events & LIMIT_CGROUP) {
+		cgroup_poll();
+	}
+	if (hook && events & LIMIT_NEAR) {
+		size_t soft = __atomic_load_n(&limit_soft, __ATOMIC_RELAXED);
+		hook(-1, __atomic_load_n(&charged_total, __ATOMIC_RELAXED),
+		     soft ? soft : __atomic_load_n(&limit_hard,
+						   __ATOMIC_RELAXED));
+	}
+	if (hook && events & LIMIT_QUOTA) {
+		Arena *arena = thread_quota_arena;
+		hook(arena - arenas,
+		     __atomic_load_n(&arena->charged, __ATOMIC_RELAXED),
+		     __atomic_load_n(&arena->quota, __ATOMIC_RELAXED));
+	}
+}
+
+static inline unsigned run_bin(uint32_t npages) {
+	return npages < RUN_BINS ? npages - 1 : RUN_BINS - 1;
+}
+
+/**
+ * Write a run's length and flags into its first and last page map entry.
+ */
+static void run_set(uint32_t page, uint32_t npages, uint32_t flags) {
+	page_map[page].npages = npages;
+	page_map[page].flags = flags;
+	page_map[page + npages - 1].npages = npages;
+	page_map[page + npages - 1].flags = flags;
+}
+
+static void run_bin_insert(uint32_t page) {
+	unsigned bin = run_bin(page_map[page].npages);
+
+	if (page_map[page].flags & RUN_DIRTY) {
+		if (!dirty_pages) {
+			dirty_since = now_ms();
+		}
+		dirty_pages += page_map[page].npages;
+	}
+
+	page_map[page].prev = RUN_NIL;
+	page_map[page].next = run_bins[bin];
+	if (run_bins[bin] != RUN_NIL) {
+		page_map[run_bins[bin]].prev = page;
+	}
+	run_bins[bin] = page;
+	run_bins_used |= 1UL << bin;
+}
+
+static void run_bin_remove(uint32_t page) {
+	unsigned bin = run_bin(page_map[page].npages);
+	PageRun *run = &page_map[page];
+
+	if (run->flags & RUN_DIRTY) {
+		dirty_pages -= run->npages;
+	}
+
+	if (run->prev != RUN_NIL) {
+		page_map[run->prev].next = run->next;
+	} else {
+		run_bins[bin] = run->next;
+	}
+	if (run->next != RUN_NIL) {
+		page_map[run->next].prev = run->prev;
+	}
+	if (run_bins[bin] == RUN_NIL) {
+		run_bins_used &= ~(1UL << bin);
+	}
+}
+
+/**
+ * Purge every dirty free run.
+ */
+static void runs_purge(void) {
+	for (unsigned bin = 0; bin < RUN_BINS; bin++) {
+		for (uint32_t page = run_bins[bin]; page != RUN_NIL;
+		     page = page_map[page].next) {
+			PageRun *run = &page_map[page];
+			if (run->flags & RUN_DIRTY) {
+				pages_purge(page_addr(page),
+					    (size_t)run->npages << page_shift);
+				run_set(page, run->npages, 0);
+			}
+		}
+	}
+	dirty_pages = 0;
+}
+
+/**
+ * Mark a run free, merge it with free neighbours and bin it. A run that ends
+ * at the top is decommitted instead, but for the large_warm_pages at its
+ * start, which stay dirty. Anything else is purged, or left dirty until the
+ * decay time has passed, or purged at once while the cgroup is under
+ * pressure. A merged run is dirty if any part of it is.
+ */
+static void run_release(uint32_t page, uint32_t npages) {
+	void	*addr = page_addr(page);
+	size_t	 bytes = (size_t)npages << page_shift;
+	uint32_t dirty =
+	    decay_ms && !__atomic_load_n(&cgroup_pressure, __ATOMIC_RELAXED)
+		? RUN_DIRTY
+		: 0;
+	uint32_t merged = 0;
+
+	if (page + npages < large_top &&
+	    !(run_flags(page + npages) & RUN_INUSE)) {
+		uint32_t next = page + npages;
+		npages += page_map[next].npages;
+		merged |= page_map[next].flags & RUN_DIRTY;
+		run_bin_remove(next);
+	}
+	if (page > 0 && !(run_flags(page - 1) & RUN_INUSE)) {
+		uint32_t prev = page - page_map[page - 1].npages;
+		npages += page_map[prev].npages;
+		merged |= page_map[prev].flags & RUN_DIRTY;
+		run_bin_remove(prev);
+		page = prev;
+	}
+
+	if (page + npages == large_top) {
+		uint32_t keep = npages < large_warm_pages ? npages
+							  : large_warm_pages;
+		large_top = page + keep;
+		if (npages > keep) {
+			pages_decommit(page_addr(large_top),
+				       (size_t)(npages - keep) << page_shift);
+		}
+		if (keep == 0) {
+			return;
+		}
+		npages = keep;
+		dirty = RUN_DIRTY;
+	}
+
+	if (!dirty) {
+		pages_purge(addr, bytes);
+	}
+	run_set(page, npages, dirty | merged);
+	run_bin_insert(page);
+	if (!__atomic_load_n(&background_active, __ATOMIC_RELAXED)) {
+		runs_decay();
+	}
+}
+
+/**
+ * Purge the dirty runs once the oldest has been dirty for the decay time.
+ */
+static void runs_decay(void) {
+	if (dirty_pages && decay_ms > 0 &&
+	    now_ms() - dirty_since >= (uint64_t)decay_ms) {
+		runs_purge();
+	}
+}
+
+/**
+ * Commit npages more pages at the top of the large region, along with their
+ * page map entries.
+ */
+static int run_extend_top(uint32_t npages) {
+	if (npages > (large_region_size >> page_shift) - large_top) {
+		return 0;
+	}
+
+	size_t map_bytes = align_up((large_top + npages) * sizeof(PageRun),
+				    page_size);
+	if (map_bytes > page_map_committed) {
+		if (!pages_commit((char *)page_map + page_map_committed,
+				  map_bytes - page_map_committed)) {
+			return 0;
+		}
+		page_map_committed = map_bytes;
+	}
+	map_bytes = align_up((size_t)(large_top + npages) *
+				 (page_size / ALIGNMENT),
+			     page_size);
+	if (map_bytes > charge_map_committed) {
+		if (!pages_commit((char *)charge_map + charge_map_committed,
+				  map_bytes - charge_map_committed)) {
+			return 0;
+		}
+		charge_map_committed = map_bytes;
+	}
+
+	if (!pages_commit(page_addr(large_top), (size_t)npages << page_shift)) {
+		return 0;
+	}
+
+	large_top += npages;
+	return 1;
+}
+
+/**
+ * Allocate a run of npages pages: the smallest non-empty exact bin, first fit
+ * in the last bin, or fresh pages from the top. Returns RUN_NIL on failure.
+ */
+static uint32_t run_alloc(uint32_t npages) {
+	uint32_t page = RUN_NIL;
+
+	uint64_t bins = run_bins_used & (~0UL << run_bin(npages));
+	if (bins & ~(1UL << (RUN_BINS - 1))) {
+		page = run_bins[__builtin_ctzl(bins)];
+	} else if (bins) {
+		unsigned scanned = 0;
+		page = run_bins[RUN_BINS - 1];
+		while (page != RUN_NIL && page_map[page].npages < npages) {
+			page = realtime && ++scanned == RUN_SCAN_MAX
+				   ? RUN_NIL
+				   : page_map[page].next;
+		}
+	}
+
+	uint32_t dirty = 0;
+	if (page != RUN_NIL) {
+		uint32_t run_pages = page_map[page].npages;
+		dirty = page_map[page].flags & RUN_DIRTY;
+		run_bin_remove(page);
+		if (run_pages > npages) {
+			run_set(page + npages, run_pages - npages, dirty);
+			run_bin_insert(page + npages);
+		}
+	} else {
+		page = large_top;
+		if (!run_extend_top(npages)) {
+			return RUN_NIL;
+		}
+	}
+
+	run_set(page, npages, RUN_INUSE | dirty);
+	return page;
+}
+
+static void *large_malloc(size_t size) {
+	if (size > large_region_size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	uint32_t page = run_alloc(align_up(size, page_size) >> page_shift);
+	if (page == RUN_NIL) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	large_allocated += (size_t)page_map[page].npages << page_shift;
+	return page_addr(page);
+}
+
+/**
+ * Resize a large block in place when the pages after it are free, otherwise
+ * move its pages to a new run with mremap instead of copying them.
+ */
+static void *large_realloc(void *ptr, size_t size) {
+	if (size > large_region_size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	uint32_t page = page_index(ptr);
+	uint32_t old_pages = page_map[page].npages;
+	uint32_t new_pages = align_up(size, page_size) >> page_shift;
+	uint32_t next = page + old_pages;
+	uint32_t tag = page_map[page].flags & RUN_TAG_MASK;
+
+	if (new_pages < old_pages) {
+		run_set(page, new_pages, RUN_INUSE);
+		run_release(page + new_pages, old_pages - new_pages);
+	} else if (new_pages > old_pages) {
+		uint32_t grow = new_pages - old_pages;
+
+		if (next == large_top && run_extend_top(grow)) {
+			run_set(page, new_pages, RUN_INUSE);
+		} else if (next < large_top && !(run_flags(next) & RUN_INUSE) &&
+			   page_map[next].npages >= grow) {
+			uint32_t next_pages = page_map[next].npages;
+			uint32_t dirty = page_map[next].flags & RUN_DIRTY;
+			run_bin_remove(next);
+			if (next_pages > grow) {
+				run_set(next + grow, next_pages - grow, dirty);
+				run_bin_insert(next + grow);
+			}
+			run_set(page, new_pages, RUN_INUSE);
+		} else {
+			if (realtime) {
+				return NULL;
+			}
+			uint32_t new_page = run_alloc(new_pages);
+			if (new_page == RUN_NIL) {
+				errno = ENOMEM;
+				return NULL;
+			}
+
+			size_t old_bytes = (size_t)old_pages << page_shift;
+			void  *new = mremap(ptr, old_bytes,
+					    (size_t)new_pages << page_shift,
+					    MREMAP_MAYMOVE | MREMAP_FIXED,
+					    page_addr(new_page));
+			if (new == MAP_FAILED) {
+				run_release(new_page, new_pages);
+				errno = ENOMEM;
+				return NULL;
+			}
+
+			/* fill the hole mremap left with fresh zero pages */
+			if (mmap(ptr, old_bytes, PROT_READ | PROT_WRITE,
+				 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1,
+				 0) == MAP_FAILED) {
+				perror("mmap");
+				exit(EXIT_FAILURE);
+			}
+			run_release(page, old_pages);
+
+			ptr = new;
+		}
+	}
+
+	large_allocated = large_allocated - ((size_t)old_pages << page_shift) +
+			  ((size_t)new_pages << page_shift);
+	if (tag) {
+		page = page_index(ptr);
+		run_set(page, new_pages, page_map[page].flags | tag);
+	}
+	return ptr;
+}
+
+static void large_free(void *ptr) {
+	uint32_t page = page_index(ptr);
+	size_t	 size = (size_t)page_map[page].npages << page_shift;
+
+	large_allocated -= size;
+	run_release(page, page_map[page].npages);
+
+	/* a large block was short-lived enough to be freed: serve blocks up to
+	 * this size from the heap from now on */
+	if (opt_engine == ENGINE_HYBRID && !realtime &&
+	    size > __atomic_load_n(&mmap_threshold, __ATOMIC_RELAXED) &&
+	    size <= MMAP_THRESHOLD_MAX) {
+		__atomic_store_n(&mmap_threshold, size, __ATOMIC_RELAXED);
+		__atomic_store_n(&trim_threshold, 2 * size, __ATOMIC_RELAXED);
+#if PRINT_DEBUG_INFO
+		fprintf(stderr, "m_malloc: mmap threshold raised to %zu\n",
+			size);
+#endif
+	}
+}
+
+/**
+ * Allocate zeroed metadata pages, never shared with objects. Called with
+ * run_lock held, or from region_init.
+ */
+static void *meta_alloc(size_t size) {
+	uint32_t npages = align_up(size, page_size) >> page_shift;
+	uint32_t page = run_alloc(npages);
+	if (page == RUN_NIL) {
+		return NULL;
+	}
+	if (page_map[page].flags & RUN_DIRTY) {
+		memset(page_addr(page), 0, (size_t)npages << page_shift);
+	}
+	run_set(page, npages, RUN_INUSE | RUN_META);
+	meta_pages += npages;
+	return page_addr(page);
+}
+
+/**
+ * Carve metadata out of dedicated page runs, one slab header at a time.
+ */
+static Slab *slab_header_alloc(void) {
+	if (slab_pool) {
+		Slab *slab = slab_pool;
+		slab_pool = slab->next;
+		return slab;
+	}
+
+	if (meta_next == meta_end) {
+		meta_next = meta_alloc((size_t)META_PAGES << page_shift);
+		if (!meta_next) {
+			return NULL;
+		}
+		meta_end = meta_next + ((size_t)META_PAGES << page_shift);
+	}
+
+	Slab *slab = (Slab *)meta_next;
+	meta_next += sizeof(Slab);
+	return slab;
+}
+
+static inline uint32_t slab_offset(Slab *slab, void *ptr) {
+	return ((char *)ptr - slab->base) &
+	       size_classes[slab->size_class].offset_mask;
+}
+
+static inline uint32_t slab_slot(Slab *slab, void *ptr) {
+	uint64_t offset = slab_offset(slab, ptr);
+	return (offset * size_classes[slab->size_class].div_magic) >> 32;
+}
+
+/**
+ * Bit i of the result is set if bitmap word i has a free slot.
+ */
+static inline unsigned slab_free_words(Slab *slab) {
+#ifdef __AVX2__
+	__m256i bits = _mm256_load_si256((const __m256i *)slab->bitmap);
+	__m256i empty = _mm256_cmpeq_epi64(bits, _mm256_setzero_si256());
+	return ~_mm256_movemask_pd(_mm256_castsi256_pd(empty)) & 0xf;
+#else
+	unsigned words = 0;
+	for (unsigned i = 0; i < SLAB_WORDS; i++) {
+		words |= (slab->bitmap[i] != 0) << i;
+	}
+	return words;
+#endif
+}
+
+static inline unsigned slab_free_count(Slab *slab) {
+	unsigned count = 0;
+	for (unsigned i = 0; i < SLAB_WORDS; i++) {
+		count += __builtin_popcountl(slab->bitmap[i]);
+	}
+	return count;
+}
+
+static void slab_list_insert(CentralList *central, Slab *slab, unsigned list) {
+	Slab **head = &central->lists[list];
+
+	/* next is read by slab run pops that lost their race */
+	slab->list = list;
+	slab->prev = NULL;
+	__atomic_store_n(&slab->next, *head, __ATOMIC_RELAXED);
+	if (*head) {
+		(*head)->prev = slab;
+	}
+	*head = slab;
+}
+
+static void slab_list_remove(CentralList *central, Slab *slab) {
+	if (slab->prev) {
+		__atomic_store_n(&slab->prev->next, slab->next,
+				 __ATOMIC_RELAXED);
+	} else {
+		central->lists[slab->list] = slab->next;
+	}
+	if (slab->next) {
+		slab->next->prev = slab->prev;
+	}
+	slab->list = SLAB_FULL;
+}
+
+/**
+ * Slab runs are pushed and popped by their header. A stack top packs the
+ * header's index in the large region with a tag that every pop and push
+ * changes, so a pop that read a top which was popped and pushed back in the
+ * meantime fails its compare-and-swap (ABA). Headers live on metadata pages
+ * and are never unmapped, so reading the next link of a header another thread
+ * just popped is safe, if stale.
+ */
+static inline uint64_t slab_run_pack(Slab *slab, uint64_t top) {
+	uint64_t index = slab ? ((char *)slab - large_start) / sizeof(Slab) + 1
+			      : 0;
+	return ((top >> 32) + 1) << 32 | index;
+}
+
+static inline Slab *slab_run_unpack(uint64_t top) {
+	uint32_t index = (uint32_t)top;
+	return index ? (Slab *)large_start + (index - 1) : NULL;
+}
+
+/* nonnull: at -O3, GCC 12 cannot tell that slab is set and flags the store to
+ * slab->next */
+static __attribute__((nonnull)) void slab_run_push(uint32_t npages,
+						   Slab	   *slab) {
+	uint64_t *stack = &slab_runs[npages - 1];
+	uint64_t  top = __atomic_load_n(stack, __ATOMIC_RELAXED);
+
+	do {
+		__atomic_store_n(&slab->next, slab_run_unpack(top),
+				 __ATOMIC_RELAXED);
+	} while (!__atomic_compare_exchange_n(stack, &top,
+					      slab_run_pack(slab, top), 1,
+					      __ATOMIC_RELEASE,
+					      __ATOMIC_RELAXED));
+	__atomic_fetch_add(&slab_runs_count[npages - 1], 1, __ATOMIC_RELAXED);
+}
+
+static Slab *slab_run_pop(uint32_t npages) {
+	uint64_t *stack = &slab_runs[npages - 1];
+	uint64_t  top = __atomic_load_n(stack, __ATOMIC_ACQUIRE);
+	Slab	 *slab;
+
+	do {
+		slab = slab_run_unpack(top);
+		if (slab == NULL) {
+			return NULL;
+		}
+	} while (!__atomic_compare_exchange_n(
+	    stack, &top,
+	    slab_run_pack(__atomic_load_n(&slab->next, __ATOMIC_RELAXED), top),
+	    1, __ATOMIC_ACQUIRE, __ATOMIC_ACQUIRE));
+	__atomic_fetch_sub(&slab_runs_count[npages - 1], 1, __ATOMIC_RELAXED);
+	return slab;
+}
+
+/**
+ * Take SLAB_RUN_BATCH runs of npages pages from the page runs in one go, keep
+ * one and push the rest. Each run is bound to a header for good: its pages
+ * point at the header until the run goes back to the page runs.
+ */
+static Slab *slab_runs_refill(uint32_t npages) {
+	Slab *slabs[SLAB_RUN_BATCH];
+	int   n = 0;
+
+	run_lock_acquire();
+	for (; n < SLAB_RUN_BATCH; n++) {
+		Slab *slab = slab_header_alloc();
+		if (slab == NULL) {
+			break;
+		}
+		uint32_t page = run_alloc(npages);
+		if (page == RUN_NIL) {
+			slab->next = slab_pool;
+			slab_pool = slab;
+			break;
+		}
+		for (uint32_t i = 0; i < npages; i++) {
+			page_map[page + i].flags = RUN_INUSE | RUN_SLAB;
+			page_map[page + i].slab = slab;
+		}
+		slab->base = page_addr(page);
+		slabs[n] = slab;
+	}
+	pthread_mutex_unlock(&run_lock);
+
+	for (int i = 1; i < n; i++) {
+		slab_run_push(npages, slabs[i]);
+	}
+	return n ? slabs[0] : NULL;
+}
+
+/**
+ * Bind a run of npages pages to a slab header for a hot slab, carved from the
+ * current hot chunk: HOT_CHUNK bytes aligned for the kernel to back them with
+ * a huge page, prefaulted once and never given back. The end of a chunk too
+ * short for the next slab stays with it. Returns NULL if there is no chunk.
+ */
+static Slab *hot_slab_alloc(uint32_t npages) {
+	uint32_t chunk_pages = HOT_CHUNK >> page_shift;
+
+	run_lock_acquire();
+	Slab *slab = slab_header_alloc();
+	if (slab && hot_next + npages > hot_end) {
+		uint32_t page = run_alloc(2 * chunk_pages - 1);
+		if (page == RUN_NIL) {
+			slab->next = slab_pool;
+			slab_pool = slab;
+			pthread_mutex_unlock(&run_lock);
+			return NULL;
+		}
+		uint32_t start = page_index((char *)align_up(
+				     (uintptr_t)page_addr(page), HOT_CHUNK));
+		uint32_t head = start - page;
+		run_set(start, chunk_pages, RUN_INUSE);
+		if (head) {
+			run_release(page, head);
+		}
+		if (head < chunk_pages - 1) {
+			run_release(start + chunk_pages, chunk_pages - 1 - head);
+		}
+		if (opt_thp == THP_DEFAULT) {
+			madvise(page_addr(start), HOT_CHUNK, MADV_HUGEPAGE);
+		}
+		pages_prefault(page_addr(start), HOT_CHUNK);
+		hot_next = start;
+		hot_end = start + chunk_pages;
+	}
+	if (slab) {
+		uint32_t page = hot_next;
+		hot_next += npages;
+		run_set(page, npages, RUN_INUSE);
+		if (hot_next < hot_end) {
+			run_set(hot_next, hot_end - hot_next, RUN_INUSE);
+		}
+		for (uint32_t i = 0; i < npages; i++) {
+			page_map[page + i].flags = RUN_INUSE | RUN_SLAB;
+			page_map[page + i].slab = slab;
+		}
+		slab->base = page_addr(page);
+	}
+	pthread_mutex_unlock(&run_lock);
+	return slab;
+}
+
+/**
+ * Give a slab run, and the header bound to it, back to the page runs.
+ * Called with run_lock held.
+ */
+static void slab_run_release(Slab *slab, uint32_t npages) {
+	run_release(page_index(slab->base), npages);
+	__atomic_store_n(&slab->next, slab_pool, __ATOMIC_RELAXED);
+	slab_pool = slab;
+}
+
+/**
+ * Create an empty slab for a size class and tag, on a cached slab run if
+ * there is one, or in a hot chunk for TAG_HOT. The slab is on no list.
+ */
+static Slab *slab_create(unsigned size_class, unsigned tag) {
+	SizeClass *class = &size_classes[size_class];
+
+	Slab *slab = tag == TAG_HOT && !realtime
+			 ? hot_slab_alloc(class->npages)
+			 : NULL;
+	if (slab == NULL && !(slab = slab_run_pop(class->npages)) &&
+	    !(slab = slab_runs_refill(class->npages))) {
+		return NULL;
+	}
+
+	uint32_t page = page_index(slab->base);
+	for (uint32_t i = 0; i < class->npages; i++) {
+		__atomic_store_n(&page_map[page + i].flags,
+				 RUN_INUSE | RUN_SLAB |
+				     size_class << RUN_CLASS_SHIFT |
+				     tag << RUN_TAG_SHIFT,
+				 __ATOMIC_RELAXED);
+	}
+
+	/* a pop that lost its race may still read next, see slab_run_pop */
+	__atomic_store_n(&slab->next, NULL, __ATOMIC_RELAXED);
+	slab->prev = NULL;
+	memset(slab->bitmap, 0, sizeof(slab->bitmap));
+	slab->size = class->size;
+	slab->size_class = size_class;
+	slab->tag = tag;
+	slab->list = SLAB_FULL;
+#if MESHING
+	slab->nmeshed = 0;
+#endif
+	for (uint32_t slot = 0; slot < class->slots; slot += 64) {
+		uint32_t n = class->slots - slot;
+		slab->bitmap[slot / 64] = n >= 64 ? ~0UL : (1UL << n) - 1;
+	}
+
+	return slab;
+}
+
+/**
+ * Cache an empty slab's run for any size class with the same page count, or
+ * give it back to the page runs if SLAB_RUNS_MAX are cached already.
+ */
+static void slab_destroy(Slab *slab) {
+	uint32_t npages = size_classes[slab->size_class].npages;
+
+#if MESHING
+	if (slab->nmeshed) {
+		run_lock_acquire();
+		/* the slab's page leaves the memfd, its pages become private */
+		mesh_unmap(page_index(slab->base));
+		fallocate(mesh_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			  (off_t)page_index(slab->base) << page_shift,
+			  page_size);
+		for (uint32_t i = 0; i < slab->nmeshed; i++) {
+			mesh_unmap(slab->meshed[i]);
+			run_release(slab->meshed[i], 1);
+		}
+		slab->nmeshed = 0;
+		--mesh_count;
+		pthread_mutex_unlock(&run_lock);
+	}
+#endif
+	if (__atomic_load_n(&slab_runs_count[npages - 1], __ATOMIC_RELAXED) <
+	    SLAB_RUNS_MAX) {
+		slab_run_push(npages, slab);
+		return;
+	}
+
+	run_lock_acquire();
+	slab_run_release(slab, npages);
+	pthread_mutex_unlock(&run_lock);
+}
+
+/**
+ * Give every cached slab run back to the page runs, so that they are purged.
+ */
+static void slab_runs_drain(void) {
+	for (uint32_t npages = 1; npages <= SLAB_PAGES_MAX; npages++) {
+		Slab *slab;
+		while ((slab = slab_run_pop(npages))) {
+			run_lock_acquire();
+			slab_run_release(slab, npages);
+			pthread_mutex_unlock(&run_lock);
+		}
+	}
+}
+
+/**
+ * Take up to n free slots from a slab in one pass over its bitmap.
+ */
+static unsigned slab_take(Slab *slab, void **out, unsigned n) {
+	unsigned words = slab_free_words(slab);
+	unsigned count = 0;
+
+	while (words && count < n) {
+		unsigned word = __builtin_ctz(words);
+		uint64_t bits = slab->bitmap[word];
+		words &= words - 1;
+
+		while (bits && count < n) {
+			unsigned slot = word * 64 + __builtin_ctzl(bits);
+			out[count++] = slab->base + slot * slab->size;
+			bits &= bits - 1;
+		}
+		slab->bitmap[word] = bits;
+	}
+
+	return count;
+}
+
+/**
+ * Move a slab to the list matching its occupancy. A slab that became empty is
+ * kept if the class has fewer than EMPTY_SLABS_MAX empty slabs, otherwise its
+ * pages go back to the page runs.
+ */
+static void slab_relist(CentralList *central, Slab *slab) {
+	unsigned slots = size_classes[slab->size_class].slots;
+	unsigned used = slots - slab_free_count(slab);
+	unsigned list;
+
+	if (used == 0) {
+		list = SLAB_EMPTY;
+	} else if (used == slots) {
+		list = SLAB_FULL;
+	} else {
+		list = used * OCCUPANCY_LISTS / slots;
+	}
+
+	if (list == slab->list) {
+		return;
+	}
+
+	if (slab->list == SLAB_EMPTY) {
+		--central->nempty;
+	}
+	if (slab->list != SLAB_FULL) {
+		slab_list_remove(central, slab);
+	}
+
+	if (list == SLAB_EMPTY && central->nempty >= central->nempty_max) {
+		slab_destroy(slab);
+		return;
+	}
+	if (list == SLAB_EMPTY) {
+		++central->nempty;
+	}
+	if (list != SLAB_FULL) {
+		slab_list_insert(central, slab, list);
+	}
+}
+
+/**
+ * Return one object to its slab.
+ */
+static void slab_put(CentralList *central, Slab *slab, void *ptr) {
+	uint32_t slot = slab_slot(slab, ptr);
+
+	slab->bitmap[slot / 64] |= 1UL << slot % 64;
+	slab_relist(central, slab);
+}
+
+/**
+ * Take n objects of a size class from a central list, fullest partial slabs
+ * first, then empty slabs, creating slabs with the list's tag as needed.
+ * Returns the number of objects taken.
+ */
+static unsigned central_list_take(CentralList *central, unsigned size_class,
+				  unsigned tag, void **out, unsigned n) {
+	unsigned count = 0;
+
+	lock_acquire(&central->lock);
+	while (count < n) {
+		Slab *slab = NULL;
+		for (int list = OCCUPANCY_LISTS - 1; list >= 0 && !slab;
+		     list--) {
+			slab = central->lists[list];
+		}
+		if (slab == NULL) {
+			slab = central->lists[SLAB_EMPTY];
+		}
+		if (slab == NULL) {
+			slab = slab_create(size_class, tag);
+			if (slab == NULL) {
+				break;
+			}
+		}
+
+		count += slab_take(slab, out + count, n - count);
+		slab_relist(central, slab);
+	}
+	central->nallocated += count;
+	lock_release(&central->lock);
+
+	return count;
+}
+
+/**
+ * Take n untagged objects of a size class from its central list.
+ */
+static unsigned central_take(unsigned size_class, void **out, unsigned n) {
+	return central_list_take(&central_lists[size_class], size_class, 0, out,
+				 n);
+}
+
+/**
+ * Return n objects to their slabs, all from one central list.
+ */
+static void central_list_put(CentralList *central, void **objects,
+			     unsigned n) {
+	lock_acquire(&central->lock);
+	for (unsigned i = 0; i < n; i++) {
+		slab_put(central, page_map[page_index(objects[i])].slab,
+			 objects[i]);
+	}
+	central->nallocated -= n;
+	lock_release(&central->lock);
+}
+
+/**
+ * Return n untagged objects of a size class to their slabs.
+ */
+static void central_put(unsigned size_class, void **objects, unsigned n) {
+	central_list_put(&central_lists[size_class], objects, n);
+}
+
+/**
+ * Fill an empty thread cache with one batch, from the transfer cache if it has
+ * one, else from the central list.
+ */
+static int cache_refill(Cache *cache, unsigned size_class, void *caller) {
+	TransferCache *transfer = &transfer_caches[size_class];
+
+	lock_acquire(&transfer->lock);
+	if (transfer->nbatches) {
+		memcpy(cache->slots, transfer->batches[--transfer->nbatches],
+		       sizeof(transfer->batches[0]));
+		cache->count = CACHE_BATCH;
+	}
+	__atomic_store_n(&transfer->nrefills, transfer->nrefills + 1,
+			 __ATOMIC_RELAXED);
+	lock_release(&transfer->lock);
+
+	if (cache->count == 0) {
+		cache->count = central_take(size_class, cache->slots,
+					    CACHE_BATCH);
+	}
+
+	prof_sample(caller, cache->count * size_classes[size_class].size);
+	return cache->count;
+}
+
+/**
+ * Move the n oldest objects out of a thread cache, as one batch to the
+ * transfer cache if it is a full batch and there is room, else to the central
+ * list. The objects leave the cache before they are handed over, so a fork
+ * child that reclaims the caches of dead threads never returns one twice.
+ */
+static void cache_flush(Cache *cache, unsigned size_class, unsigned n) {
+	TransferCache *transfer = &transfer_caches[size_class];
+	void	      *objects[CACHE_SLOTS];
+	int	       moved = 0;
+
+	memcpy(objects, cache->slots, n * sizeof(void *));
+	memmove(cache->slots, cache->slots + n,
+		(cache->count - n) * sizeof(void *));
+	__atomic_store_n(&cache->count, cache->count - n, __ATOMIC_RELEASE);
+
+	if (n == CACHE_BATCH) {
+		lock_acquire(&transfer->lock);
+		if (transfer->nbatches < TRANSFER_BATCHES) {
+			memcpy(transfer->batches[transfer->nbatches++],
+			       objects, sizeof(transfer->batches[0]));
+			moved = 1;
+		}
+		lock_release(&transfer->lock);
+	}
+
+	if (!moved) {
+		central_put(size_class, objects, n);
+	}
+}
+
+/**
+ * Move the n oldest objects out of a thread's cache of a tag, straight back
+ * to the tag's slabs: tags have no transfer caches.
+ */
+static void tag_cache_flush(Cache *cache, unsigned tag, unsigned size_class,
+			    unsigned n) {
+	void *objects[CACHE_SLOTS];
+
+	memcpy(objects, cache->slots, n * sizeof(void *));
+	memmove(cache->slots, cache->slots + n,
+		(cache->count - n) * sizeof(void *));
+	__atomic_store_n(&cache->count, cache->count - n, __ATOMIC_RELEASE);
+
+	central_list_put(&tag_lists[tag][size_class], objects, n);
+}
+
+/**
+ * Unlink an empty thread cache from the live ones and put it in the pool.
+ * Called with run_lock held.
+ */
+static void thread_cache_release(ThreadCache *tcache) {
+	if (tcache->prev) {
+		tcache->prev->next = tcache->next;
+	} else {
+		thread_caches = tcache->next;
+	}
+	if (tcache->next) {
+		tcache->next->prev = tcache->prev;
+	}
+	tcache->next = thread_cache_pool;
+	thread_cache_pool = tcache;
+}
+
+/**
+ * Wait until the thread taking the calling thread's caches is done with them.
+ */
+static __attribute__((noinline)) void thread_cache_wait(ThreadCache *tcache) {
+	do {
+		__atomic_store_n(&tcache->seq, tcache->seq + 1,
+				 __ATOMIC_RELEASE);
+		while (__atomic_load_n(&tcache->steal, __ATOMIC_ACQUIRE)) {
+			sched_yield();
+		}
+		__atomic_store_n(&tcache->seq, tcache->seq + 1,
+				 __ATOMIC_RELAXED);
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	} while (__atomic_load_n(&tcache->steal, __ATOMIC_ACQUIRE));
+}
+
+/**
+ * Mark the calling thread's caches in use. A plain store and a plain load:
+ * the membarrier of thread_caches_steal orders them against the stealer's.
+ */
+static inline void thread_cache_enter(ThreadCache *tcache) {
+	__atomic_store_n(&tcache->seq, tcache->seq + 1, __ATOMIC_RELAXED);
+	__atomic_signal_fence(__ATOMIC_SEQ_CST);
+	if (__builtin_expect(__atomic_load_n(&tcache->steal, __ATOMIC_ACQUIRE),
+			     0)) {
+		thread_cache_wait(tcache);
+	}
+}
+
+static inline void thread_cache_exit(ThreadCache *tcache) {
+	__atomic_store_n(&tcache->seq, tcache->seq + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Flush every object in a thread's caches, owned or taken by the caller.
+ */
+static void thread_cache_drain(ThreadCache *tcache) {
+	for (unsigned i = 0; i < NUM_CLASSES; i++) {
+		if (tcache->caches[i].count) {
+			cache_flush(&tcache->caches[i], i,
+				    tcache->caches[i].count);
+		}
+		if (tcache->tag_caches[i].count) {
+			tag_cache_flush(&tcache->tag_caches[i], tcache->tag, i,
+					tcache->tag_caches[i].count);
+		}
+	}
+}
+
+/**
+ * pthread key destructor: hand an exiting thread's cached objects back and
+ * recycle its caches.
+ */
+static void thread_cache_destroy(void *arg) {
+	ThreadCache *tcache = arg;
+
+	lock_acquire(&tcache->defer.lock);
+	defer_drain(&tcache->defer);
+	lock_release(&tcache->defer.lock);
+
+	/* a thread that exits inside a section no longer reads anything */
+	tcache->epoch.nest = 0;
+	__atomic_store_n(&tcache->epoch.epoch, 0, __ATOMIC_RELEASE);
+	epoch_flush(&tcache->epoch, NULL);
+
+	thread_cache_flush(tcache);
+	thread_cache = NULL;
+
+	run_lock_acquire();
+	thread_cache_release(tcache);
+	pthread_mutex_unlock(&run_lock);
+}
+
+/**
+ * Give the calling thread its caches and arrange for them to be flushed when
+ * it exits.
+ */
+static ThreadCache *thread_cache_create(void) {
+	ThreadCache *tcache;
+
+	run_lock_acquire();
+	tcache = thread_cache_pool;
+	if (tcache) {
+		thread_cache_pool = tcache->next;
+	} else if ((tcache = meta_alloc(sizeof(ThreadCache)))) {
+		tcache->registry = thread_cache_registry;
+		__atomic_store_n(&thread_cache_registry, tcache,
+				 __ATOMIC_RELEASE);
+	}
+	if (tcache) {
+		tcache->prev = NULL;
+		tcache->next = thread_caches;
+		if (thread_caches) {
+			thread_caches->prev = tcache;
+		}
+		thread_caches = tcache;
+	}
+	pthread_mutex_unlock(&run_lock);
+
+	if (tcache) {
+		pthread_setspecific(thread_cache_key, tcache);
+		thread_cache = tcache;
+	}
+	return tcache;
+}
+
+/**
+ * Give back half of every cache if a thread that could not take them asked
+ * for it, see thread_caches_steal.
+ */
+static void thread_cache_slow(ThreadCache *tcache) {
+	if (!__atomic_load_n(&tcache->gc, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	__atomic_store_n(&tcache->gc, 0, __ATOMIC_RELAXED);
+	for (unsigned i = 0; i < NUM_CLASSES; i++) {
+		if (tcache->caches[i].count >= 2) {
+			cache_flush(&tcache->caches[i], i,
+				    tcache->caches[i].count / 2);
+		}
+		if (tcache->tag_caches[i].count >= 2) {
+			tag_cache_flush(&tcache->tag_caches[i], tcache->tag, i,
+					tcache->tag_caches[i].count / 2);
+		}
+	}
+}
+
+static void *small_malloc(size_t size, void *caller) {
+	unsigned     index = size_class(size);
+	ThreadCache *tcache = thread_cache;
+
+	if (__builtin_expect(!tcache, 0) && !(tcache = thread_cache_create())) {
+		errno = ENOMEM;
+		return NULL;
+	}
+
+	long bytes = size_classes[index].size;
+	if (!charge(bytes, 1)) {
+		return NULL;
+	}
+
+	Cache *cache = &tcache->caches[index];
+	thread_cache_enter(tcache);
+	if (cache->count == 0) {
+		thread_cache_slow(tcache);
+		if (!cache_refill(cache, index, caller)) {
+			thread_cache_exit(tcache);
+			charge(-bytes, 0);
+			errno = ENOMEM;
+			return NULL;
+		}
+	}
+
+	void *ptr = cache->slots[--cache->count];
+	thread_cache_exit(tcache);
+	charge_map_set(ptr, thread_arena);
+	return ptr;
+}
+
+static void small_free(unsigned size_class, void *ptr) {
+	ThreadCache *tcache = thread_cache;
+
+	charge_to(charge_map_arena(ptr), -(long)size_classes[size_class].size,
+		  0);
+
+	if (__builtin_expect(!tcache, 0) && !(tcache = thread_cache_create())) {
+		central_put(size_class, &ptr, 1);
+		return;
+	}
+
+	Cache *cache = &tcache->caches[size_class];
+	thread_cache_enter(tcache);
+	if (cache->count >= opt_tcache_max) {
+		thread_cache_slow(tcache);
+	}
+	if (cache->count >= opt_tcache_max) {
+		cache_flush(cache, size_class,
+			    cache->count < CACHE_BATCH ? cache->count
+						       : CACHE_BATCH);
+	}
+	/* the slot is written before it is counted, for fork_child */
+	cache->slots[cache->count] = ptr;
+	__atomic_store_n(&cache->count, cache->count + 1, __ATOMIC_RELEASE);
+	thread_cache_exit(tcache);
+}
+
+/**
+ * Take a small object of the calling thread's cached tag from its cache,
+ * refilled with one batch from the tag's central list when empty. The cache
+ * first moves to the tag if the thread changed tags. Returns NULL if the tag
+ * has no object left.
+ */
+static void *tag_cache_malloc(ThreadCache *tcache, unsigned tag,
+			      unsigned size_class) {
+	Cache *cache = &tcache->tag_caches[size_class];
+	void  *ptr = NULL;
+
+	thread_cache_enter(tcache);
+	if (tcache->tag != tag) {
+		for (unsigned i = 0; i < NUM_CLASSES; i++) {
+			if (tcache->tag_caches[i].count) {
+				tag_cache_flush(&tcache->tag_caches[i],
+						tcache->tag, i,
+						tcache->tag_caches[i].count);
+			}
+		}
+		tcache->tag = tag;
+	}
+	if (cache->count == 0) {
+		thread_cache_slow(tcache);
+		cache->count =
+		    central_list_take(&tag_lists[tag][size_class], size_class,
+				      tag, cache->slots, CACHE_BATCH);
+	}
+	if (cache->count) {
+		ptr = cache->slots[--cache->count];
+	}
+	thread_cache_exit(tcache);
+	return ptr;
+}
+
+/**
+ * Put a small object in the calling thread's cache of its tag, which the
+ * caller checked to be the object's.
+ */
+static void tag_cache_free(ThreadCache *tcache, unsigned size_class,
+			   void *ptr) {
+	Cache *cache = &tcache->tag_caches[size_class];
+
+	thread_cache_enter(tcache);
+	if (cache->count >= opt_tcache_max) {
+		thread_cache_slow(tcache);
+	}
+	if (cache->count >= opt_tcache_max) {
+		tag_cache_flush(cache, tcache->tag, size_class,
+				cache->count < CACHE_BATCH ? cache->count
+							   : CACHE_BATCH);
+	}
+	cache->slots[cache->count] = ptr;
+	__atomic_store_n(&cache->count, cache->count + 1, __ATOMIC_RELEASE);
+	thread_cache_exit(tcache);
+}
+
+/**
+ * The central list of a tag and size class, created on the tag's first use.
+ * Returns NULL if there is no metadata left for it.
+ */
+static CentralList *tag_central(unsigned tag, unsigned size_class) {
+	CentralList *lists = __atomic_load_n(&tag_lists[tag], __ATOMIC_ACQUIRE);
+
+	/* central_lock_all holds the first lock while it walks the tags */
+	if (__builtin_expect(lists == NULL, 0)) {
+		lock_acquire(&central_lists[0].lock);
+		run_lock_acquire();
+		lists = tag_lists[tag];
+		if (lists == NULL &&
+		    (lists = meta_alloc(TAG_CLASSES * sizeof(CentralList)))) {
+			/* hot slabs stay, resident, once created */
+			for (unsigned i = 0; i < TAG_CLASSES; i++) {
+				lock_init(&lists[i].lock);
+				lists[i].nempty_max = tag == TAG_HOT
+							  ? UINT_MAX
+							  : EMPTY_SLABS_MAX;
+			}
+			__atomic_store_n(&tag_lists[tag], lists,
+					 __ATOMIC_RELEASE);
+		}
+		pthread_mutex_unlock(&run_lock);
+		lock_release(&central_lists[0].lock);
+	}
+	return lists ? &lists[size_class] : NULL;
+}
+
+/**
+ * Allocate a block charged to a tag. Blocks up to TAG_SMALL_MAX come from the
+ * tag's own slabs, and larger ones and page multiples from page runs, so the
+ * tag lives in the slab header and the page map and costs no byte per
+ * object. Small blocks of the thread's cached tag, see thread_cache_tag, go
+ * through its cache of that tag; other slab blocks are taken one at a time
+ * from the central list.
+ */
+static void *tagged_malloc(size_t size, unsigned tag, void *caller) {
+	void *ptr = NULL;
+	long  bytes;
+
+	if (tag_slab_size(size)) {
+		unsigned     index = tag_size_class(size);
+		CentralList *central = tag_central(tag, index);
+		ThreadCache *tcache = thread_cache;
+
+		bytes = size_classes[index].size;
+		if (central == NULL || !charge(bytes, 1)) {
+			errno = ENOMEM;
+			return NULL;
+		}
+		if (tag == thread_cache_tag() && index < NUM_CLASSES &&
+		    (tcache || (tcache = thread_cache_create()))) {
+			ptr = tag_cache_malloc(tcache, tag, index);
+		} else {
+			central_list_take(central, index, tag, &ptr, 1);
+		}
+		if (ptr == NULL) {
+			charge(-bytes, 0);
+			errno = ENOMEM;
+			return NULL;
+		}
+	} else {
+		bytes = size <= large_region_size
+			    ? (long)align_up(size, page_size)
+			    : 0;
+		if (!charge(bytes, 1)) {
+			return NULL;
+		}
+		run_lock_acquire();
+		ptr = large_malloc(size);
+		if (ptr) {
+			PageRun *run = &page_map[page_index(ptr)];
+			run_set(page_index(ptr), run->npages,
+				run->flags | tag << RUN_TAG_SHIFT);
+		}
+		pthread_mutex_unlock(&run_lock);
+		if (ptr && tag == TAG_HOT && opt_thp == THP_DEFAULT &&
+		    (size_t)bytes >= HOT_CHUNK && !realtime) {
+			madvise(ptr, bytes, MADV_HUGEPAGE);
+		}
+		if (ptr == NULL) {
+			charge(-bytes, 0);
+			return NULL;
+		}
+	}
+
+	charge_map_set(ptr, thread_arena);
+	__atomic_fetch_add(&tag_stats[tag].allocated, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&tag_stats[tag].count, 1, __ATOMIC_RELAXED);
+	prof_sample(caller, bytes);
+	return ptr;
+}
+
+/**
+ * Free a tagged block, given its first page's flags. Small ones of the
+ * calling thread's cached tag go to its cache, other slab blocks straight
+ * back to their slab.
+ */
+static void tagged_free(void *ptr, uint32_t flags) {
+	unsigned tag = (flags & RUN_TAG_MASK) >> RUN_TAG_SHIFT;
+	Arena	*arena = charge_map_arena(ptr);
+	size_t	 bytes;
+
+	if (tag == TAG_SAMPLED) {
+		life_observe(ptr);
+	}
+	if (flags & RUN_SLAB) {
+		unsigned     index = flags >> RUN_CLASS_SHIFT & 0xff;
+		CentralList *central = &tag_lists[tag][index];
+		ThreadCache *tcache = thread_cache;
+
+		bytes = size_classes[index].size;
+		if (tcache && index < NUM_CLASSES && tag == tcache->tag) {
+			tag_cache_free(tcache, index, ptr);
+		} else {
+			lock_acquire(&central->lock);
+			slab_put(central, page_map[page_index(ptr)].slab, ptr);
+			--central->nallocated;
+			lock_release(&central->lock);
+		}
+	} else {
+		bytes = (size_t)page_map[page_index(ptr)].npages << page_shift;
+		run_lock_acquire();
+		large_free(ptr);
+		pthread_mutex_unlock(&run_lock);
+	}
+
+	charge_to(arena, -(long)bytes, 0);
+	__atomic_fetch_sub(&tag_stats[tag].allocated, bytes, __ATOMIC_RELAXED);
+	__atomic_fetch_sub(&tag_stats[tag].count, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Lock every central list, the per-tag ones included, in lock order.
+ */
+static void central_lock_all(void) {
+	for (unsigned i = 0; i < NUM_CLASSES; i++) {
+		lock_acquire(&central_lists[i].lock);
+	}
+	for (unsigned tag = 1; tag < TAGS; tag++) {
+		CentralList *lists =
+		    __atomic_load_n(&tag_lists[tag], __ATOMIC_ACQUIRE);
+		for (unsigned i = 0; lists && i < TAG_CLASSES; i++) {
+			lock_acquire(&lists[i].lock);
+		}
+	}
+}
+
+/**
+ * Release the locks central_lock_all took. No tag can be created in between.
+ */
+static void central_unlock_all(void) {
+	for (unsigned tag = 1; tag < TAGS; tag++) {
+		for (unsigned i = 0; tag_lists[tag] && i < TAG_CLASSES; i++) {
+			lock_release(&tag_lists[tag][i].lock);
+		}
+	}
+	for (unsigned i = 0; i < NUM_CLASSES; i++) {
+		lock_release(&central_lists[i].lock);
+	}
+}
+
+/**
+ * Allocate a short-lived block of at most SHORT_MAX bytes from the calling
+ * thread's bump region: a pointer bump and a count, no lock, no atomic.
+ */
+static inline void *short_malloc(size_t size) {
+	ShortBump *bump = &thread_short;
+	size_t	   need = align_up(size, ALIGNMENT) + ALIGNMENT;
+
+	if (__builtin_expect((size_t)(bump->end - bump->next) < need, 0)) {
+		return short_refill(size);
+	}
+	char *ptr = bump->next + ALIGNMENT;
+	bump->next += need;
+	++bump->count;
+	((size_t *)ptr)[-1] = size;
+	return ptr;
+}
+
+/**
+ * Hand a region back to the page runs once its last block is freed.
+ */
+static void short_release(ShortRegion *region) {
+	Arena *arena = charge_map_arena(region);
+
+	run_lock_acquire();
+	run_release(page_index(region), SHORT_REGION >> page_shift);
+	pthread_mutex_unlock(&run_lock);
+	charge_to(arena, -(long)SHORT_REGION, 0);
+}
+
+/**
+ * Stop bumping the calling thread's region. It goes back as soon as every
+ * block handed out from it is freed, which may be now.
+ */
+static void short_retire(ShortBump *bump) {
+	if (bump->region &&
+	    __atomic_add_fetch(&bump->region->live, bump->count,
+			       __ATOMIC_ACQ_REL) == 0) {
+		short_release(bump->region);
+	}
+	bump->next = bump->end = NULL;
+	bump->count = 0;
+	bump->region = NULL;
+}
+
+/**
+ * Slow path of short_malloc: start over in the current region if every block
+ * from it was freed, otherwise retire it for a fresh one, charged whole.
+ */
+static __attribute__((noinline)) void *short_refill(size_t size) {
+	ShortBump   *bump = &thread_short;
+	ShortRegion *region = bump->region;
+
+	if (region && __atomic_load_n(&region->live, __ATOMIC_ACQUIRE) ==
+			  -bump->count) {
+		/* no block is left to free, so nothing races with this */
+		__atomic_store_n(&region->live, 0, __ATOMIC_RELAXED);
+	} else {
+		short_retire(bump);
+		if (!charge(SHORT_REGION, 1)) {
+			return NULL;
+		}
+
+		uint32_t npages = SHORT_REGION >> page_shift;
+		run_lock_acquire();
+		uint32_t page = run_alloc(npages);
+		if (page != RUN_NIL) {
+			region = (ShortRegion *)page_addr(page);
+			for (uint32_t i = 0; i < npages; i++) {
+				page_map[page + i].flags = RUN_INUSE | RUN_SHORT;
+				page_map[page + i].region = region;
+			}
+		}
+		if (!bump->listed) {
+			bump->bumps_prev = NULL;
+			bump->bumps_next = short_bumps;
+			if (short_bumps) {
+				short_bumps->bumps_prev = bump;
+			}
+			short_bumps = bump;
+			bump->listed = 1;
+		}
+		pthread_mutex_unlock(&run_lock);
+		if (page == RUN_NIL) {
+			charge(-(long)SHORT_REGION, 0);
+			errno = ENOMEM;
+			return NULL;
+		}
+		region->live = 0;
+		charge_map_set(region, thread_arena);
+		pthread_setspecific(short_key, bump);
+	}
+
+	/* the first block's size fits in the header's padding */
+	bump->next = (char *)(region + 1) - ALIGNMENT;
+	bump->end = (char *)region + SHORT_REGION;
+	bump->count = 0;
+	bump->region = region;
+	return short_malloc(size);
+}
+
+/**
+ * Free a short-lived block: one decrement, of the owner's count if it is the
+ * owner, then the region is bumped again from the start once it is empty, or
+ * of the live count, releasing a retired region with its last block.
+ */
+static void short_free(void *ptr) {
+	ShortRegion *region = page_map[page_index(ptr)].region;
+	ShortBump   *bump = &thread_short;
+
+#if CHECK_HEAP
+	((size_t *)ptr)[-1] = SIZE_MAX;
+#endif
+	if (region == bump->region) {
+		if (--bump->count ==
+		    -__atomic_load_n(&region->live, __ATOMIC_ACQUIRE)) {
+			bump->next = (char *)(region + 1) - ALIGNMENT;
+			bump->count = 0;
+			__atomic_store_n(&region->live, 0, __ATOMIC_RELAXED);
+		}
+		return;
+	}
+	if (__atomic_sub_fetch(&region->live, 1, __ATOMIC_ACQ_REL) == 0) {
+		short_release(region);
+	}
+}
+
+/**
+ * Thread exit: retire the thread's region and unlist it.
+ */
+static void short_detach(void *arg) {
+	ShortBump *bump = arg;
+
+	short_retire(bump);
+	run_lock_acquire();
+	if (bump->bumps_prev) {
+		bump->bumps_prev->bumps_next = bump->bumps_next;
+	} else {
+		short_bumps = bump->bumps_next;
+	}
+	if (bump->bumps_next) {
+		bump->bumps_next->bumps_prev = bump->bumps_prev;
+	}
+	bump->listed = 0;
+	pthread_mutex_unlock(&run_lock);
+}
+
+/**
+ * Free everything queued on a deferred free queue, in batches, making room
+ * for the producer after each. Called with the queue's lock held. Returns
+ * the number of pointers freed.
+ */
+static unsigned defer_drain(DeferQueue *queue) {
+	unsigned head = queue->head;
+	unsigned tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+
+	for (unsigned i = head; i != tail;) {
+		internal_free(queue->slots[i % DEFER_SLOTS]);
+		if (++i % CACHE_BATCH == 0 || i == tail) {
+			__atomic_store_n(&queue->head, i, __ATOMIC_RELEASE);
+		}
+	}
+	return tail - head;
+}
+
+static void defer_wake(void) {
+	__atomic_fetch_add(&defer_seq, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &defer_seq, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+/**
+ * The reclaimer thread: drain every thread's deferred free queue, flush what
+ * that put in its own caches and do the purging the frees left behind, then
+ * sleep. It polls every DEFER_WAIT_MS while there is work and otherwise
+ * sleeps until a producer wakes it.
+ */
+static void *defer_reclaim(void *arg) {
+	(void)arg;
+
+	for (;;) {
+		uint32_t seq = __atomic_load_n(&defer_seq, __ATOMIC_SEQ_CST);
+		unsigned freed = 0;
+
+		__atomic_store_n(&defer_idle, 1, __ATOMIC_SEQ_CST);
+		for (ThreadCache *tcache = __atomic_load_n(
+			 &thread_cache_registry, __ATOMIC_ACQUIRE);
+		     tcache; tcache = tcache->registry) {
+			DeferQueue *queue = &tcache->defer;
+			if (__atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) !=
+				__atomic_load_n(&queue->head,
+						__ATOMIC_RELAXED) &&
+			    lock_try(&queue->lock)) {
+				freed += defer_drain(queue);
+				lock_release(&queue->lock);
+			}
+		}
+
+		struct timespec timeout = {0, DEFER_WAIT_MS * 1000000L};
+		if (freed) {
+			__atomic_store_n(&defer_idle, 0, __ATOMIC_RELAXED);
+			thread_cache_flush(thread_cache);
+			run_lock_acquire();
+			runs_decay();
+			pthread_mutex_unlock(&run_lock);
+		}
+		syscall(SYS_futex, &defer_seq, FUTEX_WAIT_PRIVATE, seq,
+			freed ? &timeout : NULL, NULL, 0);
+	}
+	return NULL;
+}
+
+/**
+ * Start the reclaimer thread on first use. Returns 0 if it could not be
+ * started, in which case the caller frees synchronously.
+ */
+static int defer_start(void) {
+	int started = 0;
+
+	if (__atomic_load_n(&defer_started, __ATOMIC_ACQUIRE)) {
+		return 1;
+	}
+	if (!__atomic_compare_exchange_n(&defer_started, &started, 1, 0,
+					 __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		return 1;
+	}
+
+	pthread_t      thread;
+	pthread_attr_t attr;
+	pthread_attr_init(&attr);
+	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+	started = pthread_create(&thread, &attr, defer_reclaim, NULL) == 0;
+	pthread_attr_destroy(&attr);
+	if (!started) {
+		__atomic_store_n(&defer_started, 0, __ATOMIC_RELEASE);
+	}
+	return started;
+}
+
+void m_free_deferred(void *ptr) {
+	ThreadCache *tcache = thread_cache;
+
+	if (ptr == NULL) {
+		return;
+	}
+	if (__builtin_expect(!tcache, 0) &&
+	    (!malloc_init() || !(tcache = thread_cache_create()))) {
+		m_free(ptr);
+		return;
+	}
+
+	/* a full queue means the reclaimer is behind: pay for the free here */
+	DeferQueue *queue = &tcache->defer;
+	unsigned    tail = queue->tail;
+	unsigned    queued = tail - __atomic_load_n(&queue->head,
+						    __ATOMIC_ACQUIRE);
+	if (queued == DEFER_SLOTS || !defer_start()) {
+		m_free(ptr);
+		return;
+	}
+
+	queue->slots[tail % DEFER_SLOTS] = ptr;
+	__atomic_store_n(&queue->tail, tail + 1, __ATOMIC_SEQ_CST);
+	if ((__atomic_load_n(&defer_idle, __ATOMIC_SEQ_CST) &&
+	     __atomic_exchange_n(&defer_idle, 0, __ATOMIC_RELAXED)) ||
+	    queued + 1 == DEFER_SLOTS / 2) {
+		defer_wake();
+	}
+}
+
+/**
+ * Move the global epoch on if every thread in a section has seen the current
+ * one. Blocks retired in epoch e are safe to free once the global epoch is
+ * e + 2: any thread still reading them would have kept it at e + 1.
+ */
+static uint64_t epoch_advance(void) {
+	uint64_t global = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+
+	if (__atomic_load_n(&epoch_pinned, __ATOMIC_SEQ_CST)) {
+		return global;
+	}
+	for (ThreadCache *tcache = __atomic_load_n(&thread_cache_registry,
+						   __ATOMIC_ACQUIRE);
+	     tcache; tcache = tcache->registry) {
+		uint64_t epoch =
+		    __atomic_load_n(&tcache->epoch.epoch, __ATOMIC_SEQ_CST);
+		if (epoch && epoch >> 1 != global) {
+			return global;
+		}
+	}
+
+	if (__atomic_compare_exchange_n(&epoch_global, &global, global + 1, 0,
+					__ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+		++global;
+	}
+	return global;
+}
+
+/**
+ * Free a batch's blocks. Each comes off the batch before it is freed: a fork
+ * child flushes the batches of the threads it lost wherever they stopped, and
+ * must not free a block twice.
+ */
+static void retire_batch_free(RetireBatch *batch) {
+	while (batch->count) {
+		void *ptr = batch->ptrs[batch->count - 1];
+		batch->count--;
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		internal_free(ptr);
+	}
+}
+
+static void epoch_batch_push(RetireBatch *batch) {
+	batch->next = __atomic_load_n(&epoch_batches, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&epoch_batches, &batch->next,
+					    batch, 1, __ATOMIC_RELEASE,
+					    __ATOMIC_RELAXED)) {
+	}
+}
+
+/**
+ * Free the retired batches no reader can see anymore. The list is taken
+ * whole, so there is no ABA, and the batches still in use are pushed back.
+ */
+static void epoch_reclaim(void) {
+	uint64_t     global = epoch_advance();
+	RetireBatch *batch =
+	    __atomic_exchange_n(&epoch_batches, NULL, __ATOMIC_ACQUIRE);
+
+	while (batch) {
+		RetireBatch *next = batch->next;
+		if (batch->epoch + 2 <= global) {
+			retire_batch_free(batch);
+			internal_free(batch);
+		} else {
+			epoch_batch_push(batch);
+		}
+		batch = next;
+	}
+}
+
+/**
+ * Free a thread's retired blocks if no reader can see them anymore, or move
+ * them to a batch on the global list. They stay put if there is no memory
+ * for the batch.
+ */
+static void epoch_flush(EpochState *state, void *caller) {
+	RetireBatch *retired = &state->retired;
+
+	if (retired->count == 0) {
+		return;
+	}
+	if (retired->epoch + 2 <= epoch_advance()) {
+		retire_batch_free(retired);
+	} else {
+		RetireBatch *batch = internal_malloc(sizeof(RetireBatch), caller);
+		if (batch) {
+			/* emptied before the copy is listed, for fork_child */
+			memcpy(batch, retired, sizeof(RetireBatch));
+			retired->count = 0;
+			__atomic_signal_fence(__ATOMIC_SEQ_CST);
+			epoch_batch_push(batch);
+		}
+	}
+	epoch_reclaim();
+}
+
+/**
+ * Wait until blocks retired now are safe to free. Must not be called from
+ * inside a section.
+ */
+static void epoch_synchronize(void) {
+	uint64_t target = __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST) + 2;
+
+	while (epoch_advance() < target) {
+		sched_yield();
+	}
+}
+
+void m_epoch_enter(void) {
+	ThreadCache *tcache = thread_cache;
+
+	/* without thread state, pin the global epoch */
+	if (epoch_pinned_nest ||
+	    (__builtin_expect(!tcache, 0) &&
+	     (!malloc_init() || !(tcache = thread_cache_create())))) {
+		if (epoch_pinned_nest++ == 0) {
+			__atomic_fetch_add(&epoch_pinned, 1, __ATOMIC_SEQ_CST);
+		}
+		return;
+	}
+
+	EpochState *state = &tcache->epoch;
+	if (state->nest++ == 0) {
+		uint64_t global =
+		    __atomic_load_n(&epoch_global, __ATOMIC_RELAXED);
+		__atomic_store_n(&state->epoch, global << 1 | 1,
+				 __ATOMIC_RELAXED);
+		/* announce before reading anything shared */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	}
+}
+
+void m_epoch_exit(void) {
+	if (epoch_pinned_nest) {
+		if (--epoch_pinned_nest == 0) {
+			__atomic_fetch_sub(&epoch_pinned, 1, __ATOMIC_SEQ_CST);
+		}
+		return;
+	}
+
+	EpochState *state = &thread_cache->epoch;
+	if (--state->nest == 0) {
+		__atomic_store_n(&state->epoch, 0, __ATOMIC_RELEASE);
+	}
+}
+
+void m_free_after_epoch(void *ptr) {
+	void	    *caller = __builtin_return_address(0);
+	ThreadCache *tcache = thread_cache;
+
+	if (ptr == NULL) {
+		return;
+	}
+	if (__builtin_expect(!tcache, 0) &&
+	    (!malloc_init() || !(tcache = thread_cache_create()))) {
+		tcache = NULL;
+	}
+
+	EpochState *state = tcache ? &tcache->epoch : NULL;
+	if (state && state->retired.count == RETIRE_BATCH) {
+		epoch_flush(state, caller);
+	}
+	if (state && state->retired.count < RETIRE_BATCH) {
+		/* the block is in place before it is counted, for fork_child */
+		state->retired.ptrs[state->retired.count] = ptr;
+		state->retired.epoch =
+		    __atomic_load_n(&epoch_global, __ATOMIC_SEQ_CST);
+		__atomic_signal_fence(__ATOMIC_SEQ_CST);
+		state->retired.count++;
+		return;
+	}
+
+	/* out of memory to queue it: wait for the readers, unless this thread
+	 * is one of them, in which case the block is leaked */
+	if (!epoch_pinned_nest && !(state && state->nest)) {
+		epoch_synchronize();
+		m_free(ptr);
+	}
+}
+
+/**
+ * Create enough empty slabs of a size class to hold bytes, prefault them and
+ * put them on the central list, which keeps them as empty slabs from then on.
+ */
+static int prewarm_class(unsigned size_class, size_t bytes) {
+	CentralList *central = &central_lists[size_class];
+	size_t	     slab_bytes = (size_t)size_classes[size_class].npages
+			     << page_shift;
+
+	for (size_t n = (bytes + slab_bytes - 1) / slab_bytes; n > 0; n--) {
+		Slab *slab = slab_create(size_class, 0);
+		if (slab == NULL) {
+			return 0;
+		}
+		pages_prefault(slab->base, slab_bytes);
+
+		lock_acquire(&central->lock);
+		++central->nempty_max;
+		++central->nempty;
+		slab_list_insert(central, slab, SLAB_EMPTY);
+		lock_release(&central->lock);
+	}
+	return 1;
+}
+
+/**
+ * Commit bytes more at the top of the large region and free them, so that
+ * run_release keeps them as a dirty run for large blocks, and prefault it.
+ */
+static int prewarm_large(size_t bytes) {
+	uint32_t npages = align_up(bytes, page_size) >> page_shift;
+
+	if (npages == 0) {
+		return 1;
+	}
+	run_lock_acquire();
+	uint32_t page = large_top;
+	if (!run_extend_top(npages)) {
+		pthread_mutex_unlock(&run_lock);
+		return 0;
+	}
+	run_set(page, npages, RUN_INUSE);
+	large_warm_pages += npages;
+	run_release(page, npages);
+
+	/* the warm run may start below the new pages, after a free run */
+	npages = page_map[large_top - 1].npages;
+	pages_prefault(page_addr(large_top - npages),
+		       (size_t)npages << page_shift);
+	pthread_mutex_unlock(&run_lock);
+	return 1;
+}
+
+/**
+ * Lock everything committed so far in memory and freeze it: page runs are
+ * used for everything above SMALL_MAX, free pages are neither purged nor
+ * decommitted, and nothing more is committed, so allocations that do not fit
+ * fail. Returns 0, or mlock's error.
+ */
+static int realtime_enter(void) {
+	int err = 0;
+
+	for (unsigned i = 0; i < opt_narenas; i++) {
+		lock_acquire(&arenas[i].lock);
+	}
+	run_lock_acquire();
+	if (mlock(page_map, page_map_committed) ||
+	    mlock(charge_map, charge_map_committed) ||
+	    mlock(large_start, (size_t)large_top << page_shift)) {
+		err = errno;
+	}
+	for (unsigned i = 0; !err && i < opt_narenas; i++) {
+		if (mlock(arenas[i].start,
+			  arenas[i].committed - arenas[i].start)) {
+			err = errno;
+		}
+	}
+	if (!err) {
+		decay_ms = -1;
+		large_warm_pages = UINT32_MAX;
+		__atomic_store_n(&mmap_threshold, SMALL_MAX, __ATOMIC_RELAXED);
+		__atomic_store_n(&trim_threshold, SIZE_MAX, __ATOMIC_RELAXED);
+		__atomic_store_n(&cgroup_pressure, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&life_active, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&realtime, 1, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&run_lock);
+	for (unsigned i = 0; i < opt_narenas; i++) {
+		lock_release(&arenas[i].lock);
+	}
+	return err;
+}
+
+int m_malloc_init(const struct m_init_opts *opts) {
+	size_t small_bytes = opts ? opts->small_bytes : opt_prewarm_small;
+	size_t large_bytes = opts ? opts->large_bytes : opt_prewarm_large;
+	int    rt = opts ? opts->realtime : (int)opt_realtime;
+
+	if (!malloc_init()) {
+		return ENOMEM;
+	}
+	for (unsigned i = 0; i < NUM_CLASSES; i++) {
+		if (!prewarm_class(i, small_bytes)) {
+			return ENOMEM;
+		}
+	}
+	if (!prewarm_large(large_bytes)) {
+		return ENOMEM;
+	}
+	if (!rt || __atomic_load_n(&realtime, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+	/* the caller's cache, so that its first allocation takes none */
+	if (!thread_cache && !thread_cache_create()) {
+		return ENOMEM;
+	}
+	return realtime_enter();
+}
+
+/**
+ * Prewarm before main when M_MALLOC_CONF asks for it.
+ */
+__attribute__((constructor)) static void prewarm_at_load(void) {
+	pthread_once(&conf_once, conf_init);
+	if ((opt_prewarm_small || opt_prewarm_large || opt_realtime) &&
+	    m_malloc_init(NULL)) {
+		fprintf(stderr, "m_malloc: prewarming failed\n");
+	}
+}
+
+/**
+ * Take back the cached objects of other threads: of all of them, or only of
+ * those that made no m_malloc or m_free call since the background thread's
+ * last pass. Thread caches have no lock; their owner marks them in use with a
+ * plain store and checks for a stealer with a plain load, and the stealer
+ * flags the caches, runs membarrier, which puts a full barrier in every
+ * running thread, and then takes the caches that are not in use, so either it
+ * sees the owner in them or the owner sees its flag and waits. Caches that
+ * are in use, or every cache without membarrier or in real-time mode, are
+ * asked to give back half on their next slow path instead.
+ */
+static void thread_caches_steal(int idle_only) {
+	ThreadCache *registry =
+	    __atomic_load_n(&thread_cache_registry, __ATOMIC_ACQUIRE);
+	unsigned flagged = 0;
+
+	pthread_mutex_lock(&steal_lock);
+	if (steal_membarrier == 0) {
+		steal_membarrier =
+		    syscall(SYS_membarrier,
+			    MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0)
+			? -1
+			: 1;
+	}
+
+	for (ThreadCache *tcache = registry; tcache;
+	     tcache = tcache->registry) {
+		unsigned seq = __atomic_load_n(&tcache->seq, __ATOMIC_RELAXED);
+		int	 idle = seq == tcache->seq_seen;
+		unsigned count = 0;
+
+		if (idle_only) {
+			tcache->seq_seen = seq;
+		}
+		if (tcache == thread_cache || (idle_only && !idle)) {
+			continue;
+		}
+		for (unsigned i = 0; i < NUM_CLASSES; i++) {
+			count += __atomic_load_n(&tcache->caches[i].count,
+						 __ATOMIC_RELAXED) +
+				 __atomic_load_n(&tcache->tag_caches[i].count,
+						 __ATOMIC_RELAXED);
+		}
+		if (count == 0) {
+			continue;
+		}
+		if (steal_membarrier < 0 || realtime) {
+			__atomic_store_n(&tcache->gc, 1, __ATOMIC_RELAXED);
+			continue;
+		}
+		__atomic_store_n(&tcache->steal, 1, __ATOMIC_RELAXED);
+		flagged++;
+	}
+
+	if (flagged) {
+		syscall(SYS_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0);
+		for (ThreadCache *tcache = registry; tcache;
+		     tcache = tcache->registry) {
+			if (!tcache->steal) {
+				continue;
+			}
+			if (__atomic_load_n(&tcache->seq, __ATOMIC_ACQUIRE) &
+			    1) {
+				__atomic_store_n(&tcache->gc, 1,
+						 __ATOMIC_RELAXED);
+			} else {
+				thread_cache_drain(tcache);
+			}
+			__atomic_store_n(&tcache->steal, 0, __ATOMIC_RELEASE);
+		}
+	}
+	pthread_mutex_unlock(&steal_lock);
+}
+
+/**
+ * Keep the transfer caches of hot classes, refilled BACKGROUND_HOT times or
+ * more since the last pass, at least half full, so that their next refills
+ * find a batch ready instead of walking slabs.
+ */
+static void background_prefill(unsigned *nrefills) {
+	for (unsigned i = 0; i < NUM_CLASSES; i++) {
+		TransferCache *transfer = &transfer_caches[i];
+		unsigned       n =
+		    __atomic_load_n(&transfer->nrefills, __ATOMIC_RELAXED);
+		unsigned hot = n - nrefills[i];
+
+		nrefills[i] = n;
+		if (hot < BACKGROUND_HOT) {
+			continue;
+		}
+
+		for (int moved = 1; moved;) {
+			void *batch[CACHE_BATCH];
+
+			lock_acquire(&transfer->lock);
+			int full = transfer->nbatches >= TRANSFER_BATCHES / 2;
+			lock_release(&transfer->lock);
+			if (full) {
+				break;
+			}
+
+			unsigned count = central_take(i, batch, CACHE_BATCH);
+			moved = 0;
+			if (count == CACHE_BATCH) {
+				lock_acquire(&transfer->lock);
+				if (transfer->nbatches < TRANSFER_BATCHES) {
+					memcpy(transfer
+						   ->batches[transfer->nbatches++],
+					       batch, sizeof(batch));
+					moved = 1;
+				}
+				lock_release(&transfer->lock);
+			}
+			if (!moved && count) {
+				central_put(i, batch, count);
+			}
+		}
+	}
+}
+
+/**
+ * The background thread: once every opt_background_interval_ms, purge aged
+ * dirty runs, take back idle threads' caches, prefill hot classes, free retired
+ * epoch batches, poll the cgroup, mesh now and then, and merge the stats, so
+ * that none of it runs on the foreground paths.
+ */
+static void *background_work(void *arg) {
+	unsigned nrefills[NUM_CLASSES] = {0};
+	(void)arg;
+
+	for (unsigned pass = 1;
+	     !__atomic_load_n(&background_stop, __ATOMIC_ACQUIRE); pass++) {
+		run_lock_acquire();
+		runs_decay();
+		pthread_mutex_unlock(&run_lock);
+
+		thread_caches_steal(1);
+		background_prefill(nrefills);
+		epoch_reclaim();
+		if (cgroup_current_fd >= 0 || cgroup_psi_fd >= 0) {
+			cgroup_poll();
+		}
+#if MESHING
+		if (pass % BACKGROUND_MESH_PASSES == 0) {
+			m_malloc_mesh();
+		}
+#endif
+
+		Stats stats;
+		stats_read(&stats);
+		lock_acquire(&background_stats_lock);
+		background_stats = stats;
+		lock_release(&background_stats_lock);
+
+		struct timespec interval = {
+		    opt_background_interval_ms / 1000,
+		    opt_background_interval_ms % 1000 * 1000000};
+		syscall(SYS_futex, &background_stop, FUTEX_WAIT_PRIVATE, 0,
+			&interval, NULL, 0);
+	}
+	return NULL;
+}
+
+/**
+ * Start or stop the background thread. Returns 0, or an errno value.
+ */
+static int background_set(int active) {
+	int err = 0;
+
+	pthread_mutex_lock(&background_lock);
+	if (active && !background_active) {
+		stats_read(&background_stats);
+		background_stop = 0;
+		err = pthread_create(&background_thread, NULL, background_work,
+				     NULL);
+		__atomic_store_n(&background_active, !err, __ATOMIC_RELAXED);
+	} else if (!active && background_active) {
+		__atomic_store_n(&background_stop, 1, __ATOMIC_RELEASE);
+		syscall(SYS_futex, &background_stop, FUTEX_WAKE_PRIVATE, 1,
+			NULL, NULL, 0);
+		pthread_join(background_thread, NULL);
+		__atomic_store_n(&background_active, 0, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&background_lock);
+	return err;
+}
+
+/**
+ * atfork prepare handler: take every allocator lock, in lock order, so that
+ * no other thread is inside the allocator when the address space is copied.
+ */
+static void fork_prepare(void) {
+	/* no cache is half taken at the fork */
+	pthread_mutex_lock(&steal_lock);
+	/* consumers hold a queue lock across frees, so it comes first */
+	for (ThreadCache *tcache = __atomic_load_n(&thread_cache_registry,
+						   __ATOMIC_ACQUIRE);
+	     tcache; tcache = tcache->registry) {
+		lock_acquire(&tcache->defer.lock);
+	}
+#if MESHING
+	pthread_mutex_lock(&mesh_lock);
+#endif
+	central_lock_all();
+	for (unsigned i = 0; i < opt_narenas; i++) {
+		lock_acquire(&arenas[i].lock);
+	}
+	run_lock_acquire();
+	for (unsigned i = 0; i < NUM_CLASSES; i++) {
+		lock_acquire(&transfer_caches[i].lock);
+	}
+	lock_acquire(&life_lock);
+#if MESHING
+	mesh_fork_prepare();
+#endif
+}
+
+static void fork_parent(void) {
+#if MESHING
+	mesh_fork_parent();
+#endif
+	lock_release(&life_lock);
+	for (unsigned i = 0; i < NUM_CLASSES; i++) {
+		lock_release(&transfer_caches[i].lock);
+	}
+	pthread_mutex_unlock(&run_lock);
+	for (unsigned i = 0; i < opt_narenas; i++) {
+		lock_release(&arenas[i].lock);
+	}
+	central_unlock_all();
+#if MESHING
+	pthread_mutex_unlock(&mesh_lock);
+#endif
+	for (ThreadCache *tcache = thread_cache_registry; tcache;
+	     tcache = tcache->registry) {
+		lock_release(&tcache->defer.lock);
+	}
+	pthread_mutex_unlock(&steal_lock);
+}
+
+/**
+ * atfork child handler: only the forking thread survives, so reset the locks
+ * and arena loads, and give the child fresh caches: every cached object goes
+ * back to its slab, the forking thread's included. Slab bitmaps and caches
+ * are on metadata pages, so this copies no object page. The short-lived
+ * regions of the lost threads are retired, and the blocks they retired to
+ * epochs are freed once the forking thread's sections allow it.
+ */
+static void fork_child(void) {
+#if MESHING
+	mesh_fork_child();
+	pthread_mutex_init(&mesh_lock, NULL);
+#endif
+	for (unsigned i = 0; i < NUM_CLASSES; i++) {
+		lock_init(&transfer_caches[i].lock);
+		lock_init(&central_lists[i].lock);
+	}
+	for (unsigned tag = 1; tag < TAGS; tag++) {
+		for (unsigned i = 0; tag_lists[tag] && i < TAG_CLASSES; i++) {
+			lock_init(&tag_lists[tag][i].lock);
+		}
+	}
+	for (unsigned i = 0; i < opt_narenas; i++) {
+		lock_init(&arenas[i].lock);
+		arenas[i].nthreads = &arenas[i] == thread_arena;
+	}
+	pthread_mutex_init(&run_lock, NULL);
+	pthread_mutex_init(&steal_lock, NULL);
+	lock_init(&life_lock);
+
+	ThreadCache *next;
+	for (ThreadCache *tcache = thread_caches; tcache; tcache = next) {
+		next = tcache->next;
+		for (unsigned i = 0; i < NUM_CLASSES; i++) {
+			Cache *cache = &tcache->caches[i];
+			Cache *tag_cache = &tcache->tag_caches[i];
+			if (cache->count) {
+				central_put(i, cache->slots, cache->count);
+				cache->count = 0;
+			}
+			if (tag_cache->count) {
+				central_list_put(&tag_lists[tcache->tag][i],
+						 tag_cache->slots,
+						 tag_cache->count);
+				tag_cache->count = 0;
+			}
+		}
+		if (tcache == thread_cache) {
+			continue;
+		}
+		/* a dead thread may have been in its caches */
+		tcache->seq = 0;
+		tcache->epoch.nest = 0;
+		tcache->epoch.epoch = 0;
+		thread_cache_release(tcache);
+	}
+
+	/* the background thread is gone too; it can be restarted through
+	 * m_mallctl */
+	background_active = 0;
+	background_stop = 0;
+	lock_init(&background_stats_lock);
+
+	/* a dead thread's region goes back with its last block, and its
+	 * thread stack, where the bump lives, may be reused from now on */
+	for (ShortBump *bump = short_bumps, *next_bump; bump; bump = next_bump) {
+		next_bump = bump->bumps_next;
+		if (bump != &thread_short) {
+			short_retire(bump);
+			bump->listed = 0;
+		}
+	}
+	short_bumps = thread_short.listed ? &thread_short : NULL;
+	thread_short.bumps_next = thread_short.bumps_prev = NULL;
+
+	/* dead threads pinned the epoch only if they had no thread state, and
+	 * read nothing any more: their batches go to the global list, which is
+	 * freed as far as the forking thread's sections allow */
+	epoch_pinned = epoch_pinned_nest != 0;
+	for (ThreadCache *tcache = thread_cache_registry; tcache;
+	     tcache = tcache->registry) {
+		if (tcache != thread_cache) {
+			epoch_flush(&tcache->epoch, NULL);
+		}
+	}
+	epoch_advance();
+	epoch_advance();
+	epoch_reclaim();
+
+	/* the reclaimer is gone: free what it left queued, start another when
+	 * needed */
+	defer_started = 0;
+	defer_idle = 0;
+	for (ThreadCache *tcache = thread_cache_registry; tcache;
+	     tcache = tcache->registry) {
+		lock_init(&tcache->defer.lock);
+		defer_drain(&tcache->defer);
+	}
+}
+
+/**
+ * Find a call site in a table of PROF_SITES sites, looking at most at probes
+ * of them from its hash on, and claim a free one for it with a
+ * compare-and-swap if claim is set. Returns NULL if it is not there.
+ */
+static inline ProfSite *site_find(ProfSite *sites, void *caller,
+				  uint32_t probes, int claim) {
+	uint32_t hash = ((uintptr_t)caller * 0x9e3779b97f4a7c15UL) >>
+			(64 - PROF_BITS);
+	for (uint32_t i = 0; i < probes; i++) {
+		ProfSite *site = &sites[(hash + i) & (PROF_SITES - 1)];
+		void	 *pc = __atomic_load_n(&site->pc, __ATOMIC_ACQUIRE);
+
+		/* claim a free site, on failure pc holds the winner */
+		if (pc == NULL && claim &&
+		    __atomic_compare_exchange_n(&site->pc, &pc, caller, 0,
+						__ATOMIC_ACQ_REL,
+						__ATOMIC_ACQUIRE)) {
+			pc = caller;
+		}
+		if (pc == caller) {
+			return site;
+		}
+		if (pc == NULL) {
+			return NULL;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Charge a sample to a call site. Samples are dropped once the table is
+ * full.
+ */
+static void prof_sample(void *caller, size_t bytes) {
+	if (!__atomic_load_n(&prof_active, __ATOMIC_RELAXED)) {
+		return;
+	}
+
+	ProfSite *site = site_find(prof_sites, caller, PROF_SITES, 1);
+	if (site) {
+		__atomic_add_fetch(&site->nsamples, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&site->bytes, bytes, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * Count one lifetime of a site, LIFE_* by its length, and settle the site's
+ * verdict: short- or long-lived once 7/8 of at least LIFE_MIN lifetimes were,
+ * among the last LIFE_WINDOW or so. Called with life_lock held.
+ */
+static void life_record(ProfSite *site, unsigned kind) {
+	++site->nlifetimes;
+	site->nshort += kind == LIFE_SHORT;
+	site->nlong += kind == LIFE_LONG;
+	if (site->nlifetimes == LIFE_WINDOW) {
+		site->nlifetimes /= 2;
+		site->nshort /= 2;
+		site->nlong /= 2;
+	}
+
+	unsigned n = site->nlifetimes;
+	unsigned verdict = LIFE_NONE;
+	if (n >= LIFE_MIN && site->nshort * 8 >= n * 7) {
+		verdict = LIFE_SHORT;
+	} else if (n >= LIFE_MIN && site->nlong * 8 >= n * 7) {
+		verdict = LIFE_LONG;
+	}
+	/* sites without a verdict are not counted */
+	if (verdict != site->verdict) {
+		if (site->verdict != LIFE_NONE) {
+			__atomic_sub_fetch(&life_routed[site->verdict], 1,
+					   __ATOMIC_RELAXED);
+		}
+		if (verdict != LIFE_NONE) {
+			__atomic_add_fetch(&life_routed[verdict], 1,
+					   __ATOMIC_RELAXED);
+		}
+		__atomic_store_n(&site->verdict, verdict, __ATOMIC_RELAXED);
+	}
+}
+
+/**
+ * The index of the i-th sample slot of a block.
+ */
+static inline unsigned life_slot(void *ptr, unsigned i) {
+	uint32_t hash = ((uintptr_t)ptr * 0x9e3779b97f4a7c15UL) >> 32;
+	return (hash + i) % LIFE_TRACKED;
+}
+
+/**
+ * Sample an allocation: take it from TAG_SAMPLED slabs or runs, so that its
+ * free comes through life_observe, and track it in one of LIFE_PROBES slots
+ * from its address's hash on. A sample still tracked LIFE_LONG_NS later
+ * counts as long-lived once another sample needs its slot; a sample that
+ * finds no slot is not tracked. Returns NULL if the site table has no room
+ * for the site.
+ */
+static __attribute__((noinline)) void *life_sample(size_t size,
+						   void *caller) {
+	if (thread_life_seed == 0) {
+		thread_life_seed = (uintptr_t)&thread_life_seed;
+	}
+	thread_life_seed = thread_life_seed * 6364136223846793005UL +
+			   1442695040888963407UL;
+	thread_life_countdown =
+	    LIFE_SAMPLE / 2 + (thread_life_seed >> 33) % LIFE_SAMPLE;
+
+	ProfSite *site = site_find(life_sites, caller, LIFE_PROBES, 1);
+	void	 *ptr = site ? tagged_malloc(size, TAG_SAMPLED, caller) : NULL;
+	if (ptr == NULL) {
+		return NULL;
+	}
+
+	uint64_t now = now_ns();
+	lock_acquire(&life_lock);
+	for (unsigned i = 0; i < LIFE_PROBES; i++) {
+		LifeSample *sample = &life_samples[life_slot(ptr, i)];
+		if (sample->ptr && now - sample->born < LIFE_LONG_NS) {
+			continue;
+		}
+		if (sample->ptr) {
+			life_record(sample->site, LIFE_LONG);
+		}
+		*sample = (LifeSample){ptr, site, now};
+		break;
+	}
+	lock_release(&life_lock);
+	return ptr;
+}
+
+/**
+ * Allocate by the site's predicted lifetime: short-lived sites from the
+ * thread's short-lived region, long-lived small blocks from TAG_LONG slabs,
+ * which no short-lived block riddles with holes, through the thread's tag
+ * cache. About one allocation in
+ * LIFE_SAMPLE is sampled instead, routed sites included, so that verdicts
+ * follow sites that change. Returns NULL to leave the allocation to the
+ * usual paths.
+ */
+static inline void *life_malloc(size_t size, void *caller) {
+	if (__builtin_expect(--thread_life_countdown <= 0, 0)) {
+		return life_sample(size, caller);
+	}
+	if (!(__atomic_load_n(&life_routed[LIFE_SHORT], __ATOMIC_RELAXED) |
+	      __atomic_load_n(&life_routed[LIFE_LONG], __ATOMIC_RELAXED))) {
+		return NULL;
+	}
+
+	ProfSite *site = site_find(life_sites, caller, LIFE_PROBES, 0);
+	unsigned  verdict = LIFE_NONE;
+	void	 *ptr = NULL;
+	if (site) {
+		verdict = __atomic_load_n(&site->verdict, __ATOMIC_RELAXED);
+	}
+	if (verdict == LIFE_SHORT && size <= SHORT_MAX) {
+		ptr = short_malloc(size);
+		if (ptr) {
+			prof_sample(caller, size);
+		}
+	} else if (verdict == LIFE_LONG && size <= SMALL_MAX) {
+		ptr = tagged_malloc(size, TAG_LONG, caller);
+	}
+	return ptr;
+}
+
+/**
+ * A sampled block is being freed: count its lifetime if it is still
+ * tracked.
+ */
+static void life_observe(void *ptr) {
+	uint64_t now = now_ns();
+
+	lock_acquire(&life_lock);
+	for (unsigned i = 0; i < LIFE_PROBES; i++) {
+		LifeSample *sample = &life_samples[life_slot(ptr, i)];
+		if (sample->ptr == ptr) {
+			uint64_t lifetime = now - sample->born;
+			life_record(sample->site,
+				    lifetime < LIFE_SHORT_NS  ? LIFE_SHORT
+				    : lifetime < LIFE_LONG_NS ? LIFE_NONE
+							      : LIFE_LONG);
+			sample->ptr = NULL;
+			break;
+		}
+	}
+	lock_release(&life_lock);
+}
+
+/**
+ * Write the profile to fd, one "pc samples bytes" line per site.
+ */
+static void prof_dump(int fd) {
+	dprintf(fd, "m_malloc profile\n");
+	for (uint32_t i = 0; i < PROF_SITES; i++) {
+		ProfSite *site = &prof_sites[i];
+		void	 *pc = __atomic_load_n(&site->pc, __ATOMIC_ACQUIRE);
+		if (pc) {
+			dprintf(fd, "%p %lu %lu\n", pc,
+				__atomic_load_n(&site->nsamples, __ATOMIC_RELAXED),
+				__atomic_load_n(&site->bytes, __ATOMIC_RELAXED));
+		}
+	}
+}
+
+/**
+ * Take a consistent snapshot of the stats, with the same locks as check_heap.
+ */
+static void stats_read(Stats *stats) {
+	*stats = (Stats){0};
+
+	central_lock_all();
+	for (unsigned i = 0; i < opt_narenas; i++) {
+		lock_acquire(&arenas[i].lock);
+	}
+	run_lock_acquire();
+
+	for (unsigned i = 0; i < NUM_CLASSES; i++) {
+		stats->small_allocated +=
+		    central_lists[i].nallocated * size_classes[i].size;
+	}
+	for (unsigned tag = 1; tag < TAGS; tag++) {
+		for (unsigned i = 0; tag_lists[tag] && i < TAG_CLASSES; i++) {
+			stats->small_allocated += tag_lists[tag][i].nallocated *
+						  size_classes[i].size;
+		}
+	}
+	for (unsigned i = 0; i < opt_narenas; i++) {
+		stats->heap_allocated += arenas[i].allocated;
+		stats->mapped += arenas[i].committed - arenas[i].start;
+	}
+	stats->large_allocated = large_allocated;
+	stats->allocated = stats->small_allocated + stats->large_allocated +
+			   stats->heap_allocated;
+	stats->mapped += ((size_t)large_top << page_shift) +
+			 page_map_committed + charge_map_committed;
+	stats->dirty = dirty_pages << page_shift;
+	stats->metadata = (meta_pages << page_shift) + page_map_committed +
+			  charge_map_committed;
+	stats->mmap_threshold = mmap_threshold;
+
+	pthread_mutex_unlock(&run_lock);
+	for (unsigned i = 0; i < opt_narenas; i++) {
+		lock_release(&arenas[i].lock);
+	}
+	central_unlock_all();
+}
+
+void m_malloc_stats_print(void) {
+	Stats stats;
+
+	if (!malloc_init()) {
+		return;
+	}
+	stats_read(&stats);
+	fprintf(stderr,
+		"m_malloc stats:\n"
+		"  allocated:      %zu\n"
+		"    small:        %zu\n"
+		"    large:        %zu\n"
+		"    heap:         %zu\n"
+		"  mapped:         %zu\n"
+		"  dirty:          %zu\n"
+		"  metadata:       %zu\n"
+		"  mmap threshold: %zu\n",
+		stats.allocated, stats.small_allocated, stats.large_allocated,
+		stats.heap_allocated, stats.mapped, stats.dirty, stats.metadata,
+		stats.mmap_threshold);
+	for (unsigned i = 0; i < opt_narenas; i++) {
+		Lock *lock = &arenas[i].lock;
+		fprintf(stderr,
+			"  arena %u lock:   %lu acquired, %lu contended, "
+			"%lu ns waiting\n",
+			i, __atomic_load_n(&lock->nacquired, __ATOMIC_RELAXED),
+			__atomic_load_n(&lock->ncontended, __ATOMIC_RELAXED),
+			__atomic_load_n(&lock->wait_ns, __ATOMIC_RELAXED));
+		if (arenas[i].quota) {
+			fprintf(stderr, "  arena %u charged: %ld of %zu\n", i,
+				__atomic_load_n(&arenas[i].charged,
+						__ATOMIC_RELAXED),
+				arenas[i].quota);
+		}
+	}
+	fprintf(stderr, "  charged:        %ld\n",
+		__atomic_load_n(&charged_total, __ATOMIC_RELAXED));
+}
+
+/**
+ * Ctl - one m_mallctl name. arg is handed to the handler, e.g. the offset of
+ * a stat. A '#' in the name matches a decimal number; handlers are given the
+ * name as called to read it.
+ */
+typedef struct ctl Ctl;
+struct ctl {
+	const char *name;
+	int (*handler)(const Ctl *ctl, void *oldp, size_t *oldlenp, void *newp,
+		       size_t newlen);
+	size_t arg;
+};
+
+/**
+ * Copy a value out to oldp, if the caller asked for it.
+ */
+static int ctl_read(void *oldp, size_t *oldlenp, const void *value,
+		    size_t len) {
+	if (oldp == NULL || oldlenp == NULL) {
+		return 0;
+	}
+	if (*oldlenp != len) {
+		return EINVAL;
+	}
+	memcpy(oldp, value, len);
+	return 0;
+}
+
+/**
+ * Copy a new value in from newp. Returns 1 if there was one.
+ */
+static int ctl_write(void *newp, size_t newlen, void *value, size_t len,
+		     int *err) {
+	if (newp == NULL) {
+		return 0;
+	}
+	if (newlen != len) {
+		*err = EINVAL;
+		return 0;
+	}
+	memcpy(value, newp, len);
+	return 1;
+}
+
+static int ctl_stat(const Ctl *ctl, void *oldp, size_t *oldlenp, void *newp,
+		    size_t newlen) {
+	Stats stats;
+	(void)newlen;
+
+	if (newp) {
+		return EPERM;
+	}
+	/* the background thread merges the stats, so foreground reads need
+	 * not take every lock */
+	if (__atomic_load_n(&background_active, __ATOMIC_RELAXED)) {
+		lock_acquire(&background_stats_lock);
+		stats = background_stats;
+		lock_release(&background_stats_lock);
+	} else {
+		stats_read(&stats);
+	}
+	return ctl_read(oldp, oldlenp, (char *)&stats + ctl->arg,
+			sizeof(size_t));
+}
+
+static int ctl_opt(const Ctl *ctl, void *oldp, size_t *oldlenp, void *newp,
+		   size_t newlen) {
+	static const char *const engines[] = {"hybrid", "heap", "runs"};
+	static const char *const thp_modes[] = {"default", "always", "never"};
+	(void)newlen;
+
+	if (newp) {
+		return EPERM;
+	}
+	switch (ctl->arg) {
+		case 0:
+			return ctl_read(oldp, oldlenp, &engines[opt_engine],
+					sizeof(char *));
+		case 1:
+			return ctl_read(oldp, oldlenp, &opt_tcache_max,
+					sizeof(unsigned));
+		case 2:
+			return ctl_read(oldp, oldlenp, &opt_decay_ms,
+					sizeof(long));
+		case 3:
+			return ctl_read(oldp, oldlenp, &thp_modes[opt_thp],
+					sizeof(char *));
+		case 4:
+			return ctl_read(oldp, oldlenp, &opt_prof,
+					sizeof(unsigned));
+		case 5:
+			return ctl_read(oldp, oldlenp, &opt_stats_print,
+					sizeof(unsigned));
+		case 6:
+			return ctl_read(oldp, oldlenp, &opt_narenas,
+					sizeof(unsigned));
+		case 7:
+			return ctl_read(oldp, oldlenp, &opt_background_thread,
+					sizeof(unsigned));
+		case 8:
+			return ctl_read(oldp, oldlenp,
+					&opt_background_interval_ms,
+					sizeof(long));
+		case 9:
+			return ctl_read(oldp, oldlenp, &opt_prewarm_small,
+					sizeof(size_t));
+		case 10:
+			return ctl_read(oldp, oldlenp, &opt_prewarm_large,
+					sizeof(size_t));
+		case 11:
+			return ctl_read(oldp, oldlenp, &opt_realtime,
+					sizeof(unsigned));
+		case 12:
+			return ctl_read(oldp, oldlenp, &opt_soft_limit,
+					sizeof(size_t));
+		case 13:
+			return ctl_read(oldp, oldlenp, &opt_hard_limit,
+					sizeof(size_t));
+		case 14:
+			return ctl_read(oldp, oldlenp, &opt_cgroup,
+					sizeof(unsigned));
+		case 15:
+			return ctl_read(oldp, oldlenp, &opt_lifetime,
+					sizeof(unsigned));
+		default:
+			return ENOENT;
+	}
+}
+
+/**
+ * Lock counters: arg is the offset of the counter in Lock. Arena locks are
+ * read one at a time, the central list locks are summed.
+ */
+static int ctl_lock(const Ctl *ctl, void *oldp, size_t *oldlenp, void *newp,
+		    size_t newlen) {
+	uint64_t value = 0;
+	unsigned long index = strtoul(ctl->name + strlen("stats.arenas."),
+				      NULL, 10);
+	(void)newlen;
+
+	if (newp) {
+		return EPERM;
+	}
+	if (strncmp(ctl->name, "stats.central.", 14) == 0) {
+		for (unsigned i = 0; i < NUM_CLASSES; i++) {
+			value += __atomic_load_n(
+			    (uint64_t *)((char *)&central_lists[i].lock +
+					 ctl->arg),
+			    __ATOMIC_RELAXED);
+		}
+	} else if (index < opt_narenas) {
+		value = __atomic_load_n(
+		    (uint64_t *)((char *)&arenas[index].lock + ctl->arg),
+		    __ATOMIC_RELAXED);
+	} else {
+		return ENOENT;
+	}
+	return ctl_read(oldp, oldlenp, &value, sizeof(uint64_t));
+}
+
+static int ctl_background_thread(const Ctl *ctl, void *oldp,
+				 size_t *oldlenp, void *newp, size_t newlen) {
+	unsigned active = __atomic_load_n(&background_active, __ATOMIC_RELAXED);
+	int	 err;
+	(void)ctl;
+
+	err = ctl_read(oldp, oldlenp, &active, sizeof(unsigned));
+	if (!err && ctl_write(newp, newlen, &active, sizeof(unsigned), &err)) {
+		err = background_set(active != 0);
+	}
+	return err;
+}
+
+static int ctl_decay_ms(const Ctl *ctl, void *oldp, size_t *oldlenp,
+			void *newp, size_t newlen) {
+	long value;
+	int  err = 0;
+	(void)ctl;
+
+	run_lock_acquire();
+	value = decay_ms;
+	err = ctl_read(oldp, oldlenp, &value, sizeof(long));
+	if (!err && ctl_write(newp, newlen, &value, sizeof(long), &err)) {
+		if (realtime) {
+			err = EPERM;
+		} else if (value < -1) {
+			err = EINVAL;
+		} else {
+			decay_ms = value;
+			if (value == 0) {
+				runs_purge();
+			}
+		}
+	}
+	pthread_mutex_unlock(&run_lock);
+	return err;
+}
+
+/**
+ * Flush every object in the calling thread's caches.
+ */
+static void thread_cache_flush(ThreadCache *tcache) {
+	if (!tcache) {
+		return;
+	}
+
+	thread_cache_enter(tcache);
+	thread_cache_drain(tcache);
+	thread_cache_exit(tcache);
+}
+
+/**
+ * Trim every arena's heap, give the cached slab runs back and purge every
+ * dirty run.
+ */
+static void purge_all(void) {
+	for (unsigned i = 0; i < opt_narenas; i++) {
+		Arena *arena = &arenas[i];
+
+		lock_acquire(&arena->lock);
+		Header *epilogue = (Header *)arena->end - 1;
+		if (!(epilogue->size & CHUNK_PREV_INUSE)) {
+			heap_trim(arena, prev_chunk(epilogue), 0);
+		}
+		lock_release(&arena->lock);
+	}
+
+	slab_runs_drain();
+	run_lock_acquire();
+	runs_purge();
+	pthread_mutex_unlock(&run_lock);
+}
+
+/**
+ * Maintenance triggers: arg 0 purges aged dirty runs, 1 trims the heap and
+ * purges all dirty runs and cached slab runs, 2 flushes the calling thread's
+ * caches, 3 pages out cold memory.
+ */
+static int ctl_trigger(const Ctl *ctl, void *oldp, size_t *oldlenp,
+		       void *newp, size_t newlen) {
+	(void)oldlenp, (void)newlen;
+
+	if (oldp || newp) {
+		return EPERM;
+	}
+
+	if (ctl->arg == 2) {
+		thread_cache_flush(thread_cache);
+		return 0;
+	}
+	if (realtime) {
+		return EPERM;
+	}
+
+	if (ctl->arg == 1) {
+		purge_all();
+	} else if (ctl->arg == 3) {
+		cold_advise(1);
+	} else {
+		run_lock_acquire();
+		runs_decay();
+		pthread_mutex_unlock(&run_lock);
+	}
+	return 0;
+}
+
+/**
+ * Process limits: arg 0 is the soft limit, 1 the hard limit, 2 the hook.
+ * Lowering a limit refuses charges from then on, it frees nothing.
+ */
+static int ctl_limit(const Ctl *ctl, void *oldp, size_t *oldlenp, void *newp,
+		     size_t newlen) {
+	size_t *limit = ctl->arg == 0 ? &limit_soft : &limit_hard;
+	int	err;
+
+	if (ctl->arg == 2) {
+		m_limit_hook_t hook =
+		    __atomic_load_n(&limit_hook, __ATOMIC_ACQUIRE);
+		err = ctl_read(oldp, oldlenp, &hook, sizeof(m_limit_hook_t));
+		if (!err && ctl_write(newp, newlen, &hook,
+				      sizeof(m_limit_hook_t), &err)) {
+			__atomic_store_n(&limit_hook, hook, __ATOMIC_RELEASE);
+		}
+		return err;
+	}
+
+	size_t value = __atomic_load_n(limit, __ATOMIC_RELAXED);
+	err = ctl_read(oldp, oldlenp, &value, sizeof(size_t));
+	if (!err && ctl_write(newp, newlen, &value, sizeof(size_t), &err)) {
+		if (value > LONG_MAX) {
+			return EINVAL;
+		}
+		__atomic_store_n(limit, value, __ATOMIC_RELAXED);
+	}
+	return err;
+}
+
+/**
+ * Per-arena accounting: arg 0 is arena.<i>.quota, 1 stats.arenas.<i>.charged
+ * and 2 stats.charged. Charges still pending in threads are not counted.
+ */
+static int ctl_charge(const Ctl *ctl, void *oldp, size_t *oldlenp, void *newp,
+		      size_t newlen) {
+	const char   *digits = strpbrk(ctl->name, "0123456789");
+	unsigned long index = digits ? strtoul(digits, NULL, 10) : 0;
+	long	      charged;
+	int	      err;
+
+	if (ctl->arg == 2) {
+		if (newp) {
+			return EPERM;
+		}
+		charged = __atomic_load_n(&charged_total, __ATOMIC_RELAXED);
+		return ctl_read(oldp, oldlenp, &charged, sizeof(long));
+	}
+	if (index >= opt_narenas) {
+		return ENOENT;
+	}
+
+	Arena *arena = &arenas[index];
+	if (ctl->arg == 1) {
+		if (newp) {
+			return EPERM;
+		}
+		charged = __atomic_load_n(&arena->charged, __ATOMIC_RELAXED);
+		return ctl_read(oldp, oldlenp, &charged, sizeof(long));
+	}
+
+	size_t quota = __atomic_load_n(&arena->quota, __ATOMIC_RELAXED);
+	err = ctl_read(oldp, oldlenp, &quota, sizeof(size_t));
+	if (!err && ctl_write(newp, newlen, &quota, sizeof(size_t), &err)) {
+		if (quota > LONG_MAX) {
+			return EINVAL;
+		}
+		__atomic_store_n(&arena->quota, quota, __ATOMIC_RELAXED);
+	}
+	return err;
+}
+
+/**
+ * Per-tag stats: arg is the offset of the counter in TagStats. Tag 0 is
+ * everything untagged and is not counted.
+ */
+static int ctl_tag(const Ctl *ctl, void *oldp, size_t *oldlenp, void *newp,
+		   size_t newlen) {
+	unsigned long tag = strtoul(ctl->name + strlen("stats.tags."), NULL, 10);
+	(void)newlen;
+
+	if (newp) {
+		return EPERM;
+	}
+	if (tag == 0 || tag >= M_TAGS) {
+		return ENOENT;
+	}
+
+	size_t value = __atomic_load_n(
+	    (size_t *)((char *)&tag_stats[tag] + ctl->arg), __ATOMIC_RELAXED);
+	return ctl_read(oldp, oldlenp, &value, sizeof(size_t));
+}
+
+/**
+ * cgroup state: arg 0 is whether purging is aggressive, 1 and 2 read
+ * memory.max and memory.current afresh, ENOENT without them.
+ */
+static int ctl_cgroup(const Ctl *ctl, void *oldp, size_t *oldlenp, void *newp,
+		      size_t newlen) {
+	(void)newlen;
+
+	if (newp) {
+		return EPERM;
+	}
+	if (ctl->arg == 0) {
+		unsigned pressure =
+		    __atomic_load_n(&cgroup_pressure, __ATOMIC_RELAXED);
+		return ctl_read(oldp, oldlenp, &pressure, sizeof(unsigned));
+	}
+	if (cgroup_current_fd < 0) {
+		return ENOENT;
+	}
+
+	uint64_t value = cgroup_read(ctl->arg == 1 ? cgroup_max_fd
+						   : cgroup_current_fd);
+	return ctl_read(oldp, oldlenp, &value, sizeof(uint64_t));
+}
+
+/**
+ * Sites that lifetime prediction routes: arg is the verdict, LIFE_SHORT or
+ * LIFE_LONG.
+ */
+static int ctl_lifetime(const Ctl *ctl, void *oldp, size_t *oldlenp,
+			void *newp, size_t newlen) {
+	(void)newlen;
+
+	if (newp) {
+		return EPERM;
+	}
+	unsigned sites =
+	    __atomic_load_n(&life_routed[ctl->arg], __ATOMIC_RELAXED);
+	return ctl_read(oldp, oldlenp, &sites, sizeof(unsigned));
+}
+
+/**
+ * thread.arena: the calling thread's arena. Writing it binds the thread to
+ * that arena for good, so its charges count against that arena's quota.
+ */
+static int ctl_thread_arena(const Ctl *ctl, void *oldp, size_t *oldlenp,
+			    void *newp, size_t newlen) {
+	Arena	*arena = thread_arena ? thread_arena : arena_assign();
+	unsigned index = arena - arenas;
+	int	 err;
+	(void)ctl;
+
+	err = ctl_read(oldp, oldlenp, &index, sizeof(unsigned));
+	if (!err && ctl_write(newp, newlen, &index, sizeof(unsigned), &err)) {
+		if (index >= opt_narenas) {
+			return EINVAL;
+		}
+		arena_move(arena, &arenas[index]);
+		thread_arena_bound = 1;
+	}
+	return err;
+}
+
+static int ctl_prof_active(const Ctl *ctl, void *oldp, size_t *oldlenp,
+			   void *newp, size_t newlen) {
+	int active = __atomic_load_n(&prof_active, __ATOMIC_RELAXED);
+	int err;
+	(void)ctl;
+
+	err = ctl_read(oldp, oldlenp, &active, sizeof(int));
+	if (!err && ctl_write(newp, newlen, &active, sizeof(int), &err)) {
+		__atomic_store_n(&prof_active, active != 0, __ATOMIC_RELAXED);
+	}
+	return err;
+}
+
+/**
+ * prof.dump takes a file name, or NULL for stderr; prof.reset clears the
+ * profile.
+ */
+static int ctl_prof(const Ctl *ctl, void *oldp, size_t *oldlenp, void *newp,
+		    size_t newlen) {
+	(void)oldlenp;
+
+	if (oldp) {
+		return EPERM;
+	}
+	if (ctl->arg == 1) {
+		for (uint32_t i = 0; i < PROF_SITES; i++) {
+			__atomic_store_n(&prof_sites[i].pc, NULL,
+					 __ATOMIC_RELEASE);
+			prof_sites[i].nsamples = prof_sites[i].bytes = 0;
+		}
+		return 0;
+	}
+
+	const char *path = NULL;
+	int	    err = 0;
+	ctl_write(newp, newlen, &path, sizeof(char *), &err);
+	if (err) {
+		return err;
+	}
+
+	int fd = path ? open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC,
+			     0644)
+		      : STDERR_FILENO;
+	if (fd == -1) {
+		return errno;
+	}
+	prof_dump(fd);
+	if (path) {
+		close(fd);
+	}
+	return 0;
+}
+
+static const Ctl ctls[] = {
+    {"stats.allocated", ctl_stat, offsetof(Stats, allocated)},
+    {"stats.small.allocated", ctl_stat, offsetof(Stats, small_allocated)},
+    {"stats.large.allocated", ctl_stat, offsetof(Stats, large_allocated)},
+    {"stats.heap.allocated", ctl_stat, offsetof(Stats, heap_allocated)},
+    {"stats.mapped", ctl_stat, offsetof(Stats, mapped)},
+    {"stats.dirty", ctl_stat, offsetof(Stats, dirty)},
+    {"stats.metadata", ctl_stat, offsetof(Stats, metadata)},
+    {"stats.mmap_threshold", ctl_stat, offsetof(Stats, mmap_threshold)},
+    {"stats.arenas.#.lock.nacquired", ctl_lock, offsetof(Lock, nacquired)},
+    {"stats.arenas.#.lock.ncontended", ctl_lock, offsetof(Lock, ncontended)},
+    {"stats.arenas.#.lock.wait_ns", ctl_lock, offsetof(Lock, wait_ns)},
+    {"stats.central.lock.nacquired", ctl_lock, offsetof(Lock, nacquired)},
+    {"stats.central.lock.ncontended", ctl_lock, offsetof(Lock, ncontended)},
+    {"stats.central.lock.wait_ns", ctl_lock, offsetof(Lock, wait_ns)},
+    {"stats.arenas.#.charged", ctl_charge, 1},
+    {"stats.charged", ctl_charge, 2},
+    {"stats.tags.#.allocated", ctl_tag, offsetof(TagStats, allocated)},
+    {"stats.tags.#.count", ctl_tag, offsetof(TagStats, count)},
+    {"opt.engine", ctl_opt, 0},
+    {"opt.tcache_max", ctl_opt, 1},
+    {"opt.decay_ms", ctl_opt, 2},
+    {"opt.thp", ctl_opt, 3},
+    {"opt.prof", ctl_opt, 4},
+    {"opt.stats_print", ctl_opt, 5},
+    {"opt.narenas", ctl_opt, 6},
+    {"opt.background_thread", ctl_opt, 7},
+    {"opt.background_interval_ms", ctl_opt, 8},
+    {"opt.prewarm_small", ctl_opt, 9},
+    {"opt.prewarm_large", ctl_opt, 10},
+    {"opt.realtime", ctl_opt, 11},
+    {"opt.soft_limit", ctl_opt, 12},
+    {"opt.hard_limit", ctl_opt, 13},
+    {"opt.cgroup", ctl_opt, 14},
+    {"opt.lifetime", ctl_opt, 15},
+    {"background_thread", ctl_background_thread, 0},
+    {"arena.decay_ms", ctl_decay_ms, 0},
+    {"arena.#.quota", ctl_charge, 0},
+    {"arena.decay", ctl_trigger, 0},
+    {"arena.purge", ctl_trigger, 1},
+    {"arena.pageout", ctl_trigger, 3},
+    {"thread.tcache.flush", ctl_trigger, 2},
+    {"thread.arena", ctl_thread_arena, 0},
+    {"limit.soft", ctl_limit, 0},
+    {"limit.hard", ctl_limit, 1},
+    {"limit.hook", ctl_limit, 2},
+    {"cgroup.pressure", ctl_cgroup, 0},
+    {"cgroup.max", ctl_cgroup, 1},
+    {"cgroup.current", ctl_cgroup, 2},
+    {"lifetime.short_sites", ctl_lifetime, LIFE_SHORT},
+    {"lifetime.long_sites", ctl_lifetime, LIFE_LONG},
+    {"prof.active", ctl_prof_active, 0},
+    {"prof.dump", ctl_prof, 0},
+    {"prof.reset", ctl_prof, 1},
+};
+
+/**
+ * Match a name against a Ctl name, where '#' stands for a decimal number.
+ */
+static int ctl_match(const char *pattern, const char *name) {
+	for (; *pattern; pattern++, name++) {
+		if (*pattern == '#') {
+			if (*name < '0' || *name > '9') {
+				return 0;
+			}
+			while (name[1] >= '0' && name[1] <= '9') {
+				name++;
+			}
+		} else if (*pattern != *name) {
+			return 0;
+		}
+	}
+	return *name == '\0';
+}
+
+int m_mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp,
+	      size_t newlen) {
+	if (!malloc_init()) {
+		return EAGAIN;
+	}
+
+	for (size_t i = 0; i < sizeof(ctls) / sizeof(ctls[0]); i++) {
+		if (ctl_match(ctls[i].name, name)) {
+			Ctl ctl = {name, ctls[i].handler, ctls[i].arg};
+			return ctl.handler(&ctl, oldp, oldlenp, newp, newlen);
+		}
+	}
+	return ENOENT;
+}
+
+#if MESHING
+/**
+ * SIGSEGV handler: a thread that writes to a page while its objects are being
+ * copied waits for the copy to finish and retries on the new mapping. Other
+ * faults go to the previous handler.
+ */
+static void mesh_segv(int sig, siginfo_t *info, void *context) {
+	void *addr = info->si_addr;
+
+	/* slab pages are only ever read-only while being meshed */
+	if (in_large_region(addr) &&
+	    page_map[page_index(addr)].flags & RUN_SLAB) {
+		while (__atomic_load_n(&mesh_active, __ATOMIC_ACQUIRE)) {
+			sched_yield();
+		}
+		return;
+	}
+
+	if (mesh_old_segv.sa_flags & SA_SIGINFO) {
+		mesh_old_segv.sa_sigaction(sig, info, context);
+	} else if (mesh_old_segv.sa_handler == SIG_DFL ||
+		   mesh_old_segv.sa_handler == SIG_IGN) {
+		signal(sig, SIG_DFL);
+		raise(sig);
+	} else {
+		mesh_old_segv.sa_handler(sig);
+	}
+}
+
+/**
+ * Create a memfd as large as the large region, a hole until pages are meshed.
+ * A page is kept at the offset of its virtual page in the large region.
+ */
+static int mesh_file(void) {
+	int fd = memfd_create("m_malloc", MFD_CLOEXEC);
+
+	if (fd != -1 && ftruncate(fd, large_region_size) == -1) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+/**
+ * Set up the memfd that meshed pages move into, so that several virtual pages
+ * can map one physical page. Meshing stays off if that fails.
+ */
+static void mesh_init(void) {
+	mesh_fd = mesh_file();
+}
+
+/**
+ * Map virtual page page of the large region onto the physical page behind
+ * virtual page target.
+ */
+static void mesh_map(uint32_t page, uint32_t target) {
+	if (mmap(page_addr(page), page_size, PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_FIXED, mesh_fd,
+		 (off_t)target << page_shift) == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * Map fresh private anonymous memory over virtual page page of the large
+ * region, which takes it out of the memfd. It reads back as zero.
+ */
+static void mesh_unmap(uint32_t page) {
+	if (mmap(page_addr(page), page_size, PROT_READ | PROT_WRITE,
+		 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED) {
+		perror("mmap");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * Call fn on the base page of every meshed slab, with run_lock held.
+ */
+static void mesh_for_each(void (*fn)(Slab *slab)) {
+	if (mesh_count == 0) {
+		return;
+	}
+	for (uint32_t page = 0; page < large_top; page += page_map[page].npages) {
+		PageRun *run = &page_map[page];
+		if (run->flags & RUN_SLAB && run->slab->nmeshed &&
+		    run->slab->base == page_addr(page)) {
+			fn(run->slab);
+		}
+	}
+}
+
+static void mesh_fork_copy(Slab *slab) {
+	off_t offset = (off_t)page_index(slab->base) << page_shift;
+
+	if (mesh_fork_fd >= 0 &&
+	    pwrite(mesh_fork_fd, slab->base, page_size, offset) !=
+		(ssize_t)page_size) {
+		close(mesh_fork_fd);
+		mesh_fork_fd = -1;
+	}
+}
+
+static void mesh_fork_remap(Slab *slab) {
+	mesh_map(page_index(slab->base), page_index(slab->base));
+	for (uint32_t i = 0; i < slab->nmeshed; i++) {
+		mesh_map(slab->meshed[i], page_index(slab->base));
+	}
+}
+
+/**
+ * Fork prepare side of meshing: meshed pages are MAP_SHARED, so parent and
+ * child would write into each other's objects. Copy them, and only them, into
+ * a new memfd for the child while all locks are held; every other page of the
+ * large region is private and copied on write by fork as usual.
+ */
+static void mesh_fork_prepare(void) {
+	mesh_fork_fd = mesh_fd >= 0 ? mesh_file() : -1;
+	mesh_for_each(mesh_fork_copy);
+}
+
+static void mesh_fork_parent(void) {
+	if (mesh_fork_fd >= 0) {
+		close(mesh_fork_fd);
+	}
+}
+
+/**
+ * Fork child side of meshing: map the meshed pages onto the child's own
+ * memfd. The child meshes into it from then on, or not at all if it could not
+ * be made.
+ */
+static void mesh_fork_child(void) {
+	if (mesh_fork_fd < 0 && mesh_count) {
+		heap_error("cannot copy the meshed pages for the child", NULL);
+	}
+	close(mesh_fd);
+	mesh_fd = mesh_fork_fd;
+	mesh_for_each(mesh_fork_remap);
+}
+
+/**
+ * Can two slabs share a physical page? Their occupied slots must not overlap.
+ * Objects in thread caches count as occupied.
+ */
+static int mesh_compatible(Slab *a, Slab *b) {
+	uint32_t slots = size_classes[a->size_class].slots;
+
+	if (a->nmeshed + b->nmeshed + 2 > MESH_MAX) {
+		return 0;
+	}
+	for (uint32_t i = 0; i < SLAB_WORDS; i++) {
+		uint64_t valid = slots >= (i + 1) * 64 ? ~0UL
+			       : slots <= i * 64       ? 0
+						       : (1UL << (slots % 64)) - 1;
+		if (~a->bitmap[i] & ~b->bitmap[i] & valid) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+/**
+ * Move b's objects into a's physical page and point all of b's virtual pages
+ * at it. a's page is moved into the memfd first if it is not there yet. b's
+ * physical page is freed and its header recycled. Returns 0 if a's page
+ * could not be moved. Called with the size class's central list lock held.
+ */
+static int mesh_slabs(CentralList *central, Slab *a, Slab *b) {
+	uint32_t size = size_classes[a->size_class].size;
+	uint32_t pages[MESH_MAX];
+	uint32_t npages = 0;
+
+	pages[npages++] = page_index(b->base);
+	for (uint32_t i = 0; i < b->nmeshed; i++) {
+		pages[npages++] = b->meshed[i];
+	}
+
+	/* writers to the pages fault and wait in mesh_segv until remapped */
+	__atomic_store_n(&mesh_active, 1, __ATOMIC_RELEASE);
+	if (a->nmeshed == 0) {
+		mprotect(a->base, page_size, PROT_READ);
+		if (pwrite(mesh_fd, a->base, page_size,
+			   (off_t)page_index(a->base) << page_shift) !=
+		    (ssize_t)page_size) {
+			mprotect(a->base, page_size, PROT_READ | PROT_WRITE);
+			__atomic_store_n(&mesh_active, 0, __ATOMIC_RELEASE);
+			return 0;
+		}
+		mesh_map(page_index(a->base), page_index(a->base));
+	}
+	for (uint32_t i = 0; i < npages; i++) {
+		mprotect(page_addr(pages[i]), page_size, PROT_READ);
+	}
+
+	for (uint32_t i = 0; i < SLAB_WORDS; i++) {
+		for (uint64_t used = ~b->bitmap[i] & a->bitmap[i]; used;
+		     used &= used - 1) {
+			uint32_t offset = (i * 64 + __builtin_ctzl(used)) * size;
+			memcpy(a->base + offset, b->base + offset, size);
+		}
+	}
+
+	run_lock_acquire();
+	mesh_count += !a->nmeshed;
+	for (uint32_t i = 0; i < npages; i++) {
+		mesh_map(pages[i], page_index(a->base));
+		page_map[pages[i]].slab = a;
+		a->meshed[a->nmeshed++] = pages[i];
+	}
+	/* b->base now maps a's page; a private page went with the old mapping,
+	 * a page in the memfd is punched out of it */
+	if (b->nmeshed) {
+		fallocate(mesh_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			  (off_t)page_index(b->base) << page_shift, page_size);
+		--mesh_count;
+	}
+	__atomic_store_n(&mesh_active, 0, __ATOMIC_RELEASE);
+
+	for (uint32_t i = 0; i < SLAB_WORDS; i++) {
+		a->bitmap[i] &= b->bitmap[i];
+	}
+	if (b->list != SLAB_FULL) {
+		slab_list_remove(central, b);
+	}
+	b->next = slab_pool;
+	slab_pool = b;
+	pthread_mutex_unlock(&run_lock);
+
+	slab_relist(central, a);
+	return 1;
+}
+
+size_t m_malloc_mesh(void) {
+	size_t meshed = 0;
+
+	/* meshing gives pages back, which real-time mode never does */
+	if (__atomic_load_n(&heap_start, __ATOMIC_ACQUIRE) == NULL ||
+	    mesh_fd < 0 || __atomic_load_n(&realtime, __ATOMIC_RELAXED)) {
+		return 0;
+	}
+
+	pthread_mutex_lock(&mesh_lock);
+	if (mesh_old_segv.sa_sigaction == NULL) {
+		struct sigaction action = {.sa_sigaction = mesh_segv,
+					   .sa_flags = SA_SIGINFO | SA_NODEFER};
+		sigaction(SIGSEGV, &action, &mesh_old_segv);
+	}
+
+	for (unsigned i = 0; i < NUM_CLASSES; i++) {
+		CentralList *central = &central_lists[i];
+		if (size_classes[i].npages != 1) {
+			continue;
+		}
+
+		/* only the sparsest slabs are worth meshing */
+		lock_acquire(&central->lock);
+		for (unsigned list = 0; list < MESH_LISTS; list++) {
+			Slab *a = central->lists[list];
+			while (a) {
+				/* b only comes from after a, so a->prev stays */
+				Slab *prev = a->prev;
+				for (Slab *b = a->next, *next; b; b = next) {
+					next = b->next;
+					if (mesh_compatible(a, b) &&
+					    mesh_slabs(central, a, b)) {
+						++meshed;
+					}
+				}
+				if (a->list == list) {
+					a = a->next;
+				} else {
+					a = prev ? prev->next : central->lists[list];
+				}
+			}
+		}
+		lock_release(&central->lock);
+	}
+
+	pthread_mutex_unlock(&mesh_lock);
+	return meshed << page_shift;
+}
+#else
+size_t m_malloc_mesh(void) {
+	return 0;
+}
+#endif
+
+#if CHECK_HEAP
+/**
+ * Walk an arena's heap and free list, aborting on any inconsistency.
+ */
+static void check_arena_locked(Arena *arena) {
+	size_t	free_chunks = 0;
+	Header *epilogue = (Header *)arena->end - 1;
+	int	prev_inuse = 1;
+
+	for (Header *chunk = (Header *)arena->start; chunk != epilogue;
+	     chunk = next_chunk(chunk)) {
+		if ((uintptr_t)(chunk + 1) % ALIGNMENT ||
+		    chunk_size(chunk) < MIN_CHUNK_SIZE ||
+		    next_chunk(chunk) > epilogue) {
+			heap_error("corrupted chunk", chunk + 1);
+		}
+		if (!(chunk->size & CHUNK_PREV_INUSE) != !prev_inuse) {
+			heap_error("bad prev-in-use bit", chunk + 1);
+		}
+
+		prev_inuse = chunk->size & CHUNK_INUSE;
+		if (!prev_inuse) {
+			if (!(next_chunk(chunk)->size & CHUNK_INUSE)) {
+				heap_error("uncoalesced chunks", chunk + 1);
+			}
+			if (next_chunk(chunk)->prev_size != chunk_size(chunk)) {
+				heap_error("bad boundary tag", chunk + 1);
+			}
+			++free_chunks;
+		}
+	}
+
+	for (FreeChunk *f = arena->free_list; f; f = f->next, --free_chunks) {
+		if (f->header.size & CHUNK_INUSE ||
+		    (f->next && f->next->prev != f) ||
+		    arena_of(f) != arena) {
+			heap_error("corrupted free list", f);
+		}
+	}
+	if (free_chunks) {
+		heap_error("free chunk missing from the free list",
+			   arena->start);
+	}
+}
+
+/**
+ * Walk the arenas and the large region's page runs, aborting on any
+ * inconsistency.
+ */
+static void check_heap_locked(void) {
+	for (unsigned i = 0; i < opt_narenas; i++) {
+		check_arena_locked(&arenas[i]);
+	}
+
+	size_t	 free_runs = 0;
+	uint32_t prev_flags = RUN_INUSE;
+	uint32_t prev_pages = 0;
+	for (uint32_t page = 0; page < large_top;) {
+		PageRun *run = &page_map[page];
+		if (run->npages == 0 || page + run->npages > large_top ||
+		    page_map[page + run->npages - 1].npages != run->npages ||
+		    page_map[page + run->npages - 1].flags != run->flags) {
+			heap_error("corrupted page run", page_addr(page));
+		}
+		if (!(run->flags & RUN_INUSE)) {
+			if (!(prev_flags & RUN_INUSE)) {
+				heap_error("uncoalesced page runs",
+					   page_addr(page));
+			}
+			++free_runs;
+		}
+		prev_flags = run->flags;
+		prev_pages = run->npages;
+		page += run->npages;
+	}
+	if (!(prev_flags & RUN_INUSE) && prev_pages > large_warm_pages) {
+		heap_error("free page run at the top", page_addr(large_top));
+	}
+
+	for (unsigned bin = 0; bin < RUN_BINS; bin++) {
+		if (!(run_bins_used & (1UL << bin)) !=
+		    (run_bins[bin] == RUN_NIL)) {
+			heap_error("bad run bin bitmap", NULL);
+		}
+		for (uint32_t page = run_bins[bin]; page != RUN_NIL;
+		     page = page_map[page].next, --free_runs) {
+			if (page_map[page].flags & RUN_INUSE ||
+			    run_bin(page_map[page].npages) != bin) {
+				heap_error("corrupted run bin", page_addr(page));
+			}
+		}
+	}
+	if (free_runs) {
+		heap_error("free page run missing from its bin", NULL);
+	}
+
+	for (unsigned tag = 0; tag < TAGS; tag++) {
+		if (tag == 0 || tag_lists[tag]) {
+			check_slabs_locked(tag ? tag_lists[tag] : central_lists,
+					   tag);
+		}
+	}
+}
+
+/**
+ * Check the slab lists of one tag's central lists.
+ */
+static void check_slabs_locked(CentralList *lists, unsigned tag) {
+	for (unsigned i = 0; i < (tag ? TAG_CLASSES : NUM_CLASSES); i++) {
+		unsigned nempty = 0;
+		for (unsigned list = 0; list < SLAB_LISTS; list++) {
+			for (Slab *slab = lists[i].lists[list]; slab;
+			     slab = slab->next) {
+				unsigned used = size_classes[i].slots -
+						slab_free_count(slab);
+				unsigned expected =
+				    used == 0 ? SLAB_EMPTY
+					      : used * OCCUPANCY_LISTS /
+						    size_classes[i].slots;
+				if (slab->size_class != i || slab->tag != tag ||
+				    slab->list != list || list != expected ||
+				    page_map[page_index(slab->base)].slab !=
+					slab ||
+				    run_tag(&page_map[page_index(slab->base)]) !=
+					tag) {
+					heap_error("corrupted slab list",
+						   slab->base);
+				}
+				nempty += list == SLAB_EMPTY;
+			}
+		}
+		if (nempty != lists[i].nempty) {
+			heap_error("bad empty slab count", NULL);
+		}
+	}
+}
+
+/**
+ * Check the heap with every central list, every arena and the run lock held.
+ */
+static void check_heap(void) {
+	if (__atomic_load_n(&heap_start, __ATOMIC_ACQUIRE) == NULL) {
+		return;
+	}
+
+	central_lock_all();
+	for (unsigned i = 0; i < opt_narenas; i++) {
+		lock_acquire(&arenas[i].lock);
+	}
+	run_lock_acquire();
+
+	check_heap_locked();
+
+	pthread_mutex_unlock(&run_lock);
+	for (unsigned i = 0; i < opt_narenas; i++) {
+		lock_release(&arenas[i].lock);
+	}
+	central_unlock_all();
 }
+#endif
@@ -16,4 +16,148 @@ void *m_calloc(size_t nmemb, size_t size);
 void *m_realloc(void *ptr, size_t size);
 void  m_free(void *);
 
+/**
+ * Charge blocks to one of M_TAGS tags, e.g. one per subsystem, and read each
+ * tag's live bytes and blocks from stats.tags.<tag>.{allocated,count}. Tag 0
+ * is the default and is not counted. m_malloc_tagged allocates one block
+ * with a tag (EINVAL past M_TAGS); m_tag_set makes a tag the calling
+ * thread's default for m_malloc and m_calloc and returns the previous one, or
+ * leaves it and returns M_TAGS with errno EINVAL for a tag past M_TAGS.
+ * m_realloc keeps a block's tag. Blocks of up to 1024 bytes with the thread's
+ * m_tag_set tag go through a thread cache, as untagged ones do; other tagged
+ * blocks take a lock on every call, and no tagged block comes from the heap.
+ */
+#define M_TAGS 256
+
+void	*m_malloc_tagged(size_t size, unsigned tag);
+unsigned m_tag_set(unsigned tag);
+
+/**
+ * Placement hints for m_malloc_flags, at most one of them. M_HOT blocks are
+ * packed into their own slabs, carved from prefaulted huge pages that are
+ * never given back, so the hot working set stays dense and resident. M_COLD
+ * blocks get slabs of their own too, marked MADV_COLD when the allocator
+ * purges and paged out under cgroup pressure or on arena.pageout. A hint
+ * takes the place of the thread's tag (see m_tag_set) for that block, and
+ * m_realloc keeps it. EINVAL for unknown or conflicting flags.
+ *
+ * M_SHORT_LIVED blocks of up to 32 KiB are bumped out of a 256 KiB region
+ * of the calling thread's, which goes back whole once every block in it is
+ * freed: allocating is a pointer bump and freeing a decrement. One block
+ * that lives on keeps its whole region. With lifetime:true in M_MALLOC_CONF
+ * the allocator samples call sites, sends those whose blocks reliably die
+ * young there without the hint and packs small blocks of reliably
+ * long-lived sites together.
+ */
+#define M_HOT	      0x1
+#define M_COLD	      0x2
+#define M_SHORT_LIVED 0x4
+
+void *m_malloc_flags(size_t size, int flags);
+
+/**
+ * Memory to reserve and prefault up front: small_bytes of empty slabs for
+ * each small size class and large_bytes of free pages for large blocks.
+ * realtime then locks all of it in memory and freezes it: m_malloc and
+ * m_free never enter the kernel again and fail instead of growing.
+ */
+struct m_init_opts {
+	size_t small_bytes;
+	size_t large_bytes;
+	int    realtime;
+};
+
+/**
+ * Initialize the allocator and prefault the pools described by opts, or by
+ * the prewarm_small, prewarm_large and realtime options if opts is NULL, so
+ * that the first requests take no page faults. Pools add up over calls. Runs
+ * from a constructor when any of these options is set. Returns 0, ENOMEM, or
+ * mlock's error (EPERM, or ENOMEM past RLIMIT_MEMLOCK) for real-time mode.
+ */
+int m_malloc_init(const struct m_init_opts *opts);
+
+/**
+ * Free ptr later, on a background thread. For threads that cannot afford the
+ * cost of freeing large object graphs inline. Frees synchronously when the
+ * calling thread has too many frees queued already.
+ */
+void m_free_deferred(void *ptr);
+
+/**
+ * Epoch-based reclamation for lock-free data structures. Readers bracket
+ * their accesses with m_epoch_enter and m_epoch_exit, which nest. Writers
+ * unlink a block and pass it to m_free_after_epoch, which frees it once no
+ * reader that might have seen it is still inside a section. Retired blocks
+ * are freed in batches, so they may linger until more are retired or the
+ * thread exits.
+ */
+void m_epoch_enter(void);
+void m_epoch_exit(void);
+void m_free_after_epoch(void *ptr);
+
+/**
+ * Called by limit.hook, from the allocating thread with no allocator lock
+ * held, when the bytes charged cross a warning level upwards: the soft limit
+ * (or 7/8 of the hard limit without one) for the process, with arena -1, or
+ * 7/8 of an arena's quota. May allocate.
+ */
+typedef void (*m_limit_hook_t)(int arena, long charged, size_t limit);
+
+/**
+ * Read or write an allocator setting, jemalloc style. Reads copy *oldlenp
+ * bytes to oldp, writes take newlen bytes from newp. Returns 0, or ENOENT for
+ * an unknown name, EINVAL for a bad length or value, EPERM for a read-only
+ * name. The stats are as of the background thread's last pass when it runs.
+ * Bytes allocated are charged to the allocating thread's arena and credited
+ * back to that arena whichever thread frees them; threads settle them every
+ * 64 KiB per arena, so limits hold to within that much per thread and arena.
+ * Past the soft limit the allocator purges aggressively; past the hard limit
+ * or an arena's quota m_malloc fails with ENOMEM. Threads only count against
+ * one arena's quota once bound to it with thread.arena. opt.* report the
+ * options as parsed from M_MALLOC_CONF, which never change; arena.decay_ms
+ * and limit.* are the values in effect.
+ * Names:
+ *   stats.allocated, stats.{small,large,heap}.allocated, stats.mapped,
+ *   stats.dirty, stats.metadata, stats.mmap_threshold        size_t, r
+ *   stats.arenas.<i>.lock.{nacquired,ncontended,wait_ns},
+ *   stats.central.lock.{nacquired,ncontended,wait_ns}        uint64_t, r
+ *     (wait_ns stops counting in real-time mode)
+ *   stats.charged, stats.arenas.<i>.charged                       long, r
+ *   stats.tags.<tag>.{allocated,count}                           size_t, r
+ *   opt.engine, opt.thp                                    const char *, r
+ *   opt.tcache_max, opt.narenas, opt.prof, opt.stats_print,
+ *   opt.background_thread                                      unsigned, r
+ *   opt.decay_ms, opt.background_interval_ms                       long, r
+ *   opt.prewarm_small, opt.prewarm_large                         size_t, r
+ *   opt.realtime                                               unsigned, r
+ *   opt.soft_limit, opt.hard_limit                               size_t, r
+ *   opt.cgroup, cgroup.pressure (purging aggressively)          unsigned, r
+ *   opt.lifetime, lifetime.{short,long}_sites (routed sites)     unsigned, r
+ *   cgroup.max, cgroup.current (ENOENT outside a cgroup v2)    uint64_t, r
+ *   limit.soft, limit.hard (0: none), arena.<i>.quota (0: none) size_t, rw
+ *   limit.hook                                       m_limit_hook_t, rw
+ *   thread.arena (bind the calling thread)                    unsigned, rw
+ *   background_thread (start or stop it)                     unsigned, rw
+ *   arena.decay_ms (EPERM in real-time mode)                      long, rw
+ *   arena.decay, arena.purge, arena.pageout (EPERM in real-time mode),
+ *   thread.tcache.flush                                            trigger
+ *   prof.active                                                    int, rw
+ *   prof.dump                               const char * (NULL: stderr), w
+ *   prof.reset                                                     trigger
+ */
+int m_mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp,
+	      size_t newlen);
+
+/**
+ * Print the allocator stats to stderr.
+ */
+void m_malloc_stats_print(void);
+
+/**
+ * Merge sparse small-object pages whose live objects do not overlap and
+ * return the number of bytes released. Does nothing unless built with
+ * MESHING=1.
+ */
+size_t m_malloc_mesh(void);
+
 #endif
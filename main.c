@@ -6,6 +6,15 @@
  */
 
 #include <libc.h>
+#include <linux/seccomp.h>
+#include <pthread.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
 
 #include "m_malloc.h"
 
@@ -13,6 +22,11 @@
 #define MAX_REQUEST_SIZE 128000
 #define MAX_REQUESTS 10000
 #define REALLOC_CHANCE 10
+#define RETIRE_THREADS 4
+#define RETIRE_FORKS 300
+#define CONTEND_THREADS 3
+#define CONTEND_REQUESTS 20000
+#define CONTEND_LIVE 64
 
 /**
  * Driver options
@@ -20,6 +34,9 @@
 typedef struct options Options;
 struct options {
 	int test_libc_malloc;
+	int fork_retire;
+	int realtime;
+	int seccomp;
 	int verbose;
 };
 
@@ -87,6 +104,40 @@ unsigned long hash(unsigned char *p, size_t size) {
 	return h;
 }
 
+/**
+ * Read the cycle counter, or a nanosecond clock where there is none. Strict
+ * seccomp makes the cycle counter trap, and the clock reads it, so it is 0
+ * there.
+ */
+uint64_t cycles(const Options *options) {
+	if (options->seccomp) {
+		return 0;
+	}
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+#endif
+}
+
+/**
+ * Read the processor time, or 0 under strict seccomp, where the system call
+ * behind clock() would kill the process.
+ */
+clock_t cpu_time(const Options *options) {
+	return options->seccomp ? 0 : clock();
+}
+
+/**
+ * Raise a worst case to a new measurement.
+ */
+void worst_case(const Options *options, uint64_t *worst, uint64_t start) {
+	uint64_t elapsed = cycles(options) - start;
+	*worst = elapsed > *worst ? elapsed : *worst;
+}
+
 /**
  * Initialize a Job. It is important to use this function, as it fills the
  * allocated memory and then computes a hash that is later used as a checksum.
@@ -118,6 +169,160 @@ int check_hash(Job *job) {
 	return job->hash == hash(job->p, job->size);
 }
 
+/**
+ * Get the bytes m_malloc has mapped
+ */
+size_t get_mapped(void) {
+	size_t mapped;
+	size_t len = sizeof(mapped);
+
+	if (m_mallctl("stats.mapped", &mapped, &len, NULL, 0)) {
+		fprintf(stderr, "m_mallctl failed\n");
+		exit(EXIT_FAILURE);
+	}
+	return mapped;
+}
+
+/**
+ * Check that page-multiple requests come back page-aligned, including after a
+ * large free has raised the mmap threshold past them.
+ */
+void check_page_alignment(void) {
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t sizes[] = {page, 2 * page, 16 * page, 32 * page, 1UL << 20};
+
+	m_free(m_malloc(1UL << 20));
+	for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		void *p = m_malloc(sizes[i]);
+		if (p == NULL || (uintptr_t)p % page) {
+			printf("m_malloc(%zu) not page-aligned: %p\n", sizes[i],
+			       p);
+			exit(EXIT_FAILURE);
+		}
+		m_free(p);
+	}
+}
+
+static int retire_stop;
+
+/**
+ * Retire blocks to epochs until told to stop.
+ */
+void *retire_loop(void *arg) {
+	(void)arg;
+	while (!__atomic_load_n(&retire_stop, __ATOMIC_RELAXED)) {
+		m_free_after_epoch(m_malloc(64));
+	}
+	return NULL;
+}
+
+/**
+ * Fork while other threads retire blocks to epochs, some of them in the
+ * middle of freeing a batch. The child inherits their retired blocks and must
+ * free each exactly once.
+ */
+void check_fork_retire(void) {
+	pthread_t threads[RETIRE_THREADS];
+
+	for (int i = 0; i < RETIRE_THREADS; i++) {
+		if (pthread_create(&threads[i], NULL, retire_loop, NULL)) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (int i = 0; i < RETIRE_FORKS; i++) {
+		int   status;
+		pid_t pid = fork();
+		if (pid == 0) {
+			m_free_after_epoch(m_malloc(64));
+			m_free(m_malloc(64));
+			_exit(EXIT_SUCCESS);
+		}
+		if (pid < 0 || waitpid(pid, &status, 0) != pid ||
+		    !WIFEXITED(status) || WEXITSTATUS(status)) {
+			printf("fork while retiring to epochs failed\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	__atomic_store_n(&retire_stop, 1, __ATOMIC_RELAXED);
+	for (int i = 0; i < RETIRE_THREADS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+}
+
+static unsigned contend_ready;
+static unsigned contend_done;
+static int	contend_go;
+static int	contend_failed;
+
+/**
+ * Allocate and free next to the main loop under -s, so that the allocator's
+ * locks are contended in real-time mode. Runs under strict seccomp of its
+ * own, which is per thread, so it only spins, takes its random numbers from
+ * xorshift instead of rand, which may sleep on a lock, and ends with the exit
+ * system call, without the thread exit handlers.
+ */
+void *contend_loop(void *arg) {
+	void	*live[CONTEND_LIVE] = {NULL};
+	uint64_t x = (uintptr_t)arg * 0x9e3779b97f4a7c15UL + 1;
+
+	/* the thread's cache, while it may still enter the kernel */
+	m_free(m_malloc(1));
+	if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_STRICT)) {
+		perror("prctl");
+		exit(EXIT_FAILURE);
+	}
+	__atomic_add_fetch(&contend_ready, 1, __ATOMIC_RELEASE);
+	while (!__atomic_load_n(&contend_go, __ATOMIC_ACQUIRE)) {
+	}
+
+	for (int i = 0; i < CONTEND_REQUESTS; i++) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		void **p = &live[x % CONTEND_LIVE];
+		if (*p) {
+			m_free(*p);
+			*p = NULL;
+			continue;
+		}
+		/* mostly small blocks, for the central lists, some page
+		 * runs */
+		size_t size = (x >> 8) % 8 ? (x >> 16) % 512 + 1
+					   : (x >> 16) % 65536 + 1;
+		if ((*p = m_malloc(size)) == NULL) {
+			__atomic_store_n(&contend_failed, 1, __ATOMIC_RELAXED);
+			break;
+		}
+		memset(*p, 0xa5, size);
+	}
+	for (int i = 0; i < CONTEND_LIVE; i++) {
+		m_free(live[i]);
+	}
+
+	__atomic_add_fetch(&contend_done, 1, __ATOMIC_RELEASE);
+	syscall(SYS_exit, 0);
+	return NULL;
+}
+
+/**
+ * Start the threads of contend_loop and wait until they are under seccomp.
+ */
+void contend_start(void) {
+	for (long i = 0; i < CONTEND_THREADS; i++) {
+		pthread_t thread;
+		if (pthread_create(&thread, NULL, contend_loop, (void *)i)) {
+			fprintf(stderr, "pthread_create failed\n");
+			exit(EXIT_FAILURE);
+		}
+		pthread_detach(thread);
+	}
+	while (__atomic_load_n(&contend_ready, __ATOMIC_ACQUIRE) !=
+	       CONTEND_THREADS) {
+		sched_yield();
+	}
+}
+
 /**
  * Get current position of brk
  */
@@ -135,7 +340,12 @@ uintptr_t getbrk(void) {
  * initialize cli args to defaults
  */
 Options *initialize_options(Options *options) {
-	*options = (Options){.test_libc_malloc = 0, .verbose = 0};
+	*options = (Options){
+	    .test_libc_malloc = 0,
+	    .fork_retire = 0,
+	    .realtime = 0,
+	    .seccomp = 0,
+	    .verbose = 0};
 	return options;
 }
 
@@ -144,16 +354,26 @@ Options *initialize_options(Options *options) {
  */
 void parse_options(Options *options, int argc, char *argv[]) {
 	int opt;
-	while ((opt = getopt(argc, argv, "gv")) != -1) {
+	while ((opt = getopt(argc, argv, "fgrsv")) != -1) {
 		switch (opt) {
+			case 'f':
+				options->fork_retire = 1;
+				break;
 			case 'g':
 				options->test_libc_malloc = 1;
 				break;
+			case 'r':
+				options->realtime = 1;
+				break;
+			case 's':
+				options->realtime = 1;
+				options->seccomp = 1;
+				break;
 			case 'v':
 				options->verbose = 1;
 				break;
 			default:
-				fprintf(stderr, "accepted flags: -g -v");
+				fprintf(stderr, "accepted flags: -f -g -r -s -v");
 				exit(EXIT_FAILURE);
 		}
 	}
@@ -166,6 +386,14 @@ int main(int argc, char *argv[]) {
 	/* check flags */
 	Options config;
 	parse_options(initialize_options(&config), argc, argv);
+	if (config.seccomp && config.test_libc_malloc) {
+		fprintf(stderr, "-s tests m_malloc only\n");
+		exit(EXIT_FAILURE);
+	}
+	if (config.fork_retire && (config.test_libc_malloc || config.realtime)) {
+		fprintf(stderr, "-f tests m_malloc without real-time mode\n");
+		exit(EXIT_FAILURE);
+	}
 
 	/* assign function pointers */
 	malloc_t  mallocp;
@@ -181,17 +409,54 @@ int main(int argc, char *argv[]) {
 		freep = m_free;
 	}
 
+	/* real-time mode: every live job, and the copy a realloc makes, fits in
+	 * the large pool, with room for fragmentation */
+	if (config.realtime && !config.test_libc_malloc) {
+		struct m_init_opts init = {.small_bytes = 64 * 1024,
+					   .large_bytes = 4UL * BUFSIZE *
+							  MAX_REQUEST_SIZE,
+					   .realtime = 1};
+		int		   err = m_malloc_init(&init);
+		if (err) {
+			fprintf(stderr, "m_malloc_init: %s\n", strerror(err));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (!config.test_libc_malloc) {
+		check_page_alignment();
+	}
+	if (config.fork_retire) {
+		check_fork_retire();
+	}
+
 	Job jobs[BUFSIZE] = {NULL};
 
 	unsigned malloc_count = 0;
 	unsigned free_count = 0;
 
 	uintptr_t heap_start = getbrk();
+	size_t	  heap_size = 0;
 	size_t	  max_payload = 0;
 	size_t	  curr_payload = 0;
 
-	clock_t clocks = 0;
-	double	execution_time;
+	clock_t	 clocks = 0;
+	double	 execution_time;
+	uint64_t worst_malloc = 0;
+	uint64_t worst_realloc = 0;
+	uint64_t worst_free = 0;
+
+	/* real-time mode must not enter the kernel after init: from here on,
+	 * any system call but read, write and exit kills the process; other
+	 * threads contend for the allocator's locks meanwhile */
+	if (config.seccomp) {
+		contend_start();
+		if (prctl(PR_SET_SECCOMP, SECCOMP_MODE_STRICT)) {
+			perror("prctl");
+			exit(EXIT_FAILURE);
+		}
+		__atomic_store_n(&contend_go, 1, __ATOMIC_RELEASE);
+	}
 
 	for (int i = 0; i < MAX_REQUESTS; i++) {
 		size_t j = m_rand(BUFSIZE);
@@ -201,9 +466,11 @@ int main(int argc, char *argv[]) {
 			size_t requested_size =
 			    m_rand(MAX_REQUEST_SIZE - 1) + 1;
 
-			clock_t start = clock();
-			void   *p = mallocp(requested_size);
-			clocks += clock() - start;
+			clock_t	 start = cpu_time(&config);
+			uint64_t start_cycles = cycles(&config);
+			void	*p = mallocp(requested_size);
+			worst_case(&config, &worst_malloc, start_cycles);
+			clocks += cpu_time(&config) - start;
 
 			curr_payload += requested_size;
 			max_payload = curr_payload > max_payload ? curr_payload
@@ -240,9 +507,11 @@ int main(int argc, char *argv[]) {
 				size_t requested_size =
 				    m_rand(MAX_REQUEST_SIZE - 1) + 1;
 
-				clock_t start = clock();
-				void   *p = reallocp(jobs[j].p, requested_size);
-				clocks += clock() - start;
+				clock_t	 start = cpu_time(&config);
+				uint64_t start_cycles = cycles(&config);
+				void *p = reallocp(jobs[j].p, requested_size);
+				worst_case(&config, &worst_realloc, start_cycles);
+				clocks += cpu_time(&config) - start;
 
 				curr_payload -= jobs[j].size;
 				curr_payload += requested_size;
@@ -266,9 +535,11 @@ int main(int argc, char *argv[]) {
 				++free_count;
 			} else {
 				// free
-				clock_t start = clock();
+				clock_t	 start = cpu_time(&config);
+				uint64_t start_cycles = cycles(&config);
 				freep(jobs[j].p);
-				clocks += clock() - start;
+				worst_case(&config, &worst_free, start_cycles);
+				clocks += cpu_time(&config) - start;
 
 				curr_payload -= jobs[j].size;
 
@@ -282,11 +553,30 @@ int main(int argc, char *argv[]) {
 				++free_count;
 			}
 		}
+
+		/* m_malloc maps outside brk, track its peak mapping instead;
+		 * m_mallctl takes every allocator lock, so read it once */
+		if (!config.test_libc_malloc) {
+			size_t mapped = get_mapped();
+			heap_size = mapped > heap_size ? mapped : heap_size;
+		}
+	}
+
+	if (config.seccomp) {
+		while (__atomic_load_n(&contend_done, __ATOMIC_ACQUIRE) !=
+		       CONTEND_THREADS) {
+		}
+		if (__atomic_load_n(&contend_failed, __ATOMIC_RELAXED)) {
+			printf("malloc returned null in a contending thread\n");
+			exit(EXIT_FAILURE);
+		}
 	}
 
 	/* print statistics */
 	execution_time = (double)clocks / CLOCKS_PER_SEC;
-	size_t heap_size = getbrk() - heap_start;
+	if (config.test_libc_malloc) {
+		heap_size = getbrk() - heap_start;
+	}
 
 	printf(
 	    "calls to malloc: %d\ncalls to free: %d\nexecution time (seconds): %f\n",
@@ -294,7 +584,14 @@ int main(int argc, char *argv[]) {
 	printf("secs/call: %f, calls/sec: %f\n",
 	       execution_time / (malloc_count + free_count),
 	       (malloc_count + free_count) / execution_time);
+	printf("worst-case cycles: malloc %lu, realloc %lu, free %lu\n",
+	       worst_malloc, worst_realloc, worst_free);
 	printf("total heap size: %zu\n", heap_size);
 	printf("peak utilization: %f%%\n",
 	       !heap_size ? 100 : (double)max_payload / heap_size * 100);
+
+	/* exit_group is not allowed under strict seccomp */
+	if (config.seccomp) {
+		syscall(SYS_exit, 0);
+	}
 }